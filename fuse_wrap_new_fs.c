@@ -14,48 +14,101 @@
 #include <sys/time.h>
 #include <unistd.h>
 
-static int fuse_getattr(const char *path, struct stat *stbuf) {
-    int res = 0;
-    int size;
+#define VIRTUAL_FILE_SIZE 65536
 
-    memset(stbuf, 0, sizeof(struct stat));
+// entries fetched from sfs_readdir at a time
+#define READDIR_PAGE 64
+
+// the stats and latency files are made up from the counters on every read
+static bool is_virtual_file(const char *path) {
+    return strcmp(path, SFS_STATS_FILE) == 0 ||
+           strcmp(path, SFS_LATENCY_FILE) == 0;
+}
+
+/*
+ * Returns the text of a virtual file, its length goes in length
+ */
+static char *virtual_file_text(const char *path, int *length) {
+    char *text = malloc(VIRTUAL_FILE_SIZE);
+    if (strcmp(path, SFS_STATS_FILE) == 0)
+        *length = sfs_stats_format(text, VIRTUAL_FILE_SIZE);
+    else
+        *length = sfs_latency_format(text, VIRTUAL_FILE_SIZE);
+    return text;
+}
 
-    if (strcmp(path, "/") == 0) {
+static void fill_stat(const sfs_attr *attr, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = attr->inode;
+    stbuf->st_size = attr->size;
+    if (attr->directory) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if ((size = sfs_getfilesize(path)) != -1) {
+    } else {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
-    } else
-        res = -ENOENT;
+    }
+}
+
+static int fuse_getattr(const char *path, struct stat *stbuf) {
+    int res = 0;
+    sfs_attr attr;
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (is_virtual_file(path)) {
+        int length;
+        free(virtual_file_text(path, &length));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = length;
+    } else if (sfs_stat(path, &attr) == -1) {
+        res = -errno;
+    } else {
+        fill_stat(&attr, stbuf);
+    }
 
     return res;
 }
 
+/*
+ * Entries are filled with their offset: "." is 1, ".." 2 and an entry is 2 +
+ * the sfs_readdir cookie after it. The kernel comes back with the offset of
+ * the last entry it took once its buffer is full
+ */
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi) {
-    char file_name[MAXFILENAME];
-
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
-
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    while (sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    sfs_dirent entries[READDIR_PAGE];
+    struct stat st;
+    long cookie = offset > 2 ? offset - 2 : 0;
+    int count;
+
+    if (offset < 1 && filler(buf, ".", NULL, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+        return 0;
+
+    while ((count = sfs_readdir(path, cookie, entries, READDIR_PAGE)) > 0) {
+        for (int i = 0; i < count; i++) {
+            fill_stat(&entries[i].attr, &st);
+            if (filler(buf, entries[i].name, &st, entries[i].cookie + 2))
+                return 0;
+        }
+        cookie = entries[count - 1].cookie;
     }
+    if (count == -1)
+        return -errno;
 
     return 0;
 }
 
 static int fuse_unlink(const char *path) {
     int res;
-    char filename[MAXFILENAME];
 
-    strcpy(filename, path);
-    res = sfs_remove(filename);
+    if (is_virtual_file(path))
+        return -EACCES;
+
+    res = sfs_remove(path);
     if (res == -1)
         return -errno;
 
@@ -64,78 +117,78 @@ static int fuse_unlink(const char *path) {
 
 static int fuse_open(const char *path, struct fuse_file_info *fi) {
     int res;
-    char filename[MAXFILENAME];
 
-    strcpy(filename, path);
+    // the counters change between reads, the size from getattr is stale
+    if (is_virtual_file(path)) {
+        fi->direct_io = 1;
+        return 0;
+    }
 
-    res = sfs_fopen(filename);
+    res = sfs_fopen(path);
     if (res == -1)
         return -errno;
 
-    sfs_fclose(res);
+    // kept open until release
+    fi->fh = res;
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi) {
-    int fd;
     int res;
 
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if (sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (is_virtual_file(path)) {
+        int length;
+        char *text = virtual_file_text(path, &length);
+        res = offset < length ? length - offset : 0;
+        if ((size_t)res > size)
+            res = size;
+        memcpy(buf, text + offset, res);
+        free(text);
+        return res;
+    }
 
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi) {
-    int fd;
     int res;
 
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
+    if (is_virtual_file(path))
+        return -EACCES;
 
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if (sfs_fseek(fd, offset) == -1)
-        return -errno;
-
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fi->fh, buf, size, offset);
     if (res == -1)
         return -errno;
 
-    sfs_fclose(fd);
     return res;
 }
 
-static int fuse_truncate(const char *path, off_t size) {
-    char filename[MAXFILENAME];
-    int fd;
+static int fuse_release(const char *path, struct fuse_file_info *fi) {
+    if (!is_virtual_file(path))
+        sfs_fclose(fi->fh);
+    return 0;
+}
 
-    strcpy(filename, path);
+static int fuse_truncate(const char *path, off_t size) {
+    // truncating a virtual file resets what it shows
+    if (strcmp(path, SFS_STATS_FILE) == 0) {
+        sfs_stats_reset();
+        return 0;
+    }
+    if (strcmp(path, SFS_LATENCY_FILE) == 0) {
+        sfs_latency_reset();
+        return 0;
+    }
 
-    fd = sfs_remove(filename);
-    if (fd == -1)
+    if (sfs_truncate(path, size) == -1)
         return -errno;
 
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -144,31 +197,170 @@ static int fuse_access(const char *path, int mask) { return 0; }
 static int fuse_mknod(const char *path, mode_t mode, dev_t rdev) { return 0; }
 
 static int fuse_create(const char *path, mode_t mode,
-                       struct fuse_file_info *fp) {
-    char filename[MAXFILENAME];
+                       struct fuse_file_info *fi) {
     int fd;
 
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    if (is_virtual_file(path))
+        return -EEXIST;
 
-    sfs_fclose(fd);
+    fd = sfs_fopen(path);
+    if (fd == -1)
+        return -errno;
+
+    fi->fh = fd;
     return 0;
 }
 
+static int fuse_mkdir(const char *path, mode_t mode) {
+    if (is_virtual_file(path))
+        return -EEXIST;
+
+    if (sfs_mkdir(path) == -1)
+        return -errno;
+
+    return 0;
+}
+
+static int fuse_rmdir(const char *path) {
+    if (is_virtual_file(path))
+        return -ENOTDIR;
+
+    if (sfs_rmdir(path) == -1)
+        return -errno;
+
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int isdatasync,
+                      struct fuse_file_info *fi) {
+    if (sfs_sync() == -1)
+        return -EIO;
+
+    return 0;
+}
+
+// fuse_main forks into the background after mksfs, the background threads
+// are started again in the daemon
+static void *fuse_init(struct fuse_conn_info *conn) {
+    sfs_start();
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data) { sfs_unmount(); }
+
+/*
+ * The handlers are timed into the latency histograms
+ */
+static int timed_getattr(const char *path, struct stat *stbuf) {
+    long start = sfs_latency_start();
+    int res = fuse_getattr(path, stbuf);
+    sfs_latency_record(OP_GETATTR, start);
+    return res;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_readdir(path, buf, filler, offset, fi);
+    sfs_latency_record(OP_READDIR, start);
+    return res;
+}
+
+static int timed_unlink(const char *path) {
+    long start = sfs_latency_start();
+    int res = fuse_unlink(path);
+    sfs_latency_record(OP_UNLINK, start);
+    return res;
+}
+
+static int timed_truncate(const char *path, off_t size) {
+    long start = sfs_latency_start();
+    int res = fuse_truncate(path, size);
+    sfs_latency_record(OP_TRUNCATE, start);
+    return res;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_open(path, fi);
+    sfs_latency_record(OP_OPEN, start);
+    return res;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_read(path, buf, size, offset, fi);
+    sfs_latency_record(OP_READ, start);
+    return res;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_write(path, buf, size, offset, fi);
+    sfs_latency_record(OP_WRITE, start);
+    return res;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_release(path, fi);
+    sfs_latency_record(OP_RELEASE, start);
+    return res;
+}
+
+static int timed_create(const char *path, mode_t mode,
+                        struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_create(path, mode, fi);
+    sfs_latency_record(OP_CREATE, start);
+    return res;
+}
+
+static int timed_fsync(const char *path, int isdatasync,
+                       struct fuse_file_info *fi) {
+    long start = sfs_latency_start();
+    int res = fuse_fsync(path, isdatasync, fi);
+    sfs_latency_record(OP_FSYNC, start);
+    return res;
+}
+
+static int timed_mkdir(const char *path, mode_t mode) {
+    long start = sfs_latency_start();
+    int res = fuse_mkdir(path, mode);
+    sfs_latency_record(OP_MKDIR, start);
+    return res;
+}
+
+static int timed_rmdir(const char *path) {
+    long start = sfs_latency_start();
+    int res = fuse_rmdir(path);
+    sfs_latency_record(OP_RMDIR, start);
+    return res;
+}
+
 static struct fuse_operations xmp_oper = {
-    .getattr = fuse_getattr,
-    .readdir = fuse_readdir,
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
     .mknod = fuse_mknod,
-    .unlink = fuse_unlink,
-    .truncate = fuse_truncate,
-    .open = fuse_open,
-    .read = fuse_read,
-    .write = fuse_write,
+    .unlink = timed_unlink,
+    .truncate = timed_truncate,
+    .open = timed_open,
+    .read = timed_read,
+    .write = timed_write,
+    .release = timed_release,
     .access = fuse_access,
-    .create = fuse_create,
+    .create = timed_create,
+    .fsync = timed_fsync,
+    .mkdir = timed_mkdir,
+    .rmdir = timed_rmdir,
+    .init = fuse_init,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[]) {
+    sfs_latency_install_dump();
     mksfs(1);
     return fuse_main(argc, argv, &xmp_oper, NULL);
 }
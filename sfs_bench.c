@@ -0,0 +1,368 @@
+/*
+ * Microbenchmarks of the sfs_api layer, linked without FUSE (make bench).
+ * Results are printed as JSON on stdout, progress goes to stderr. The disk
+ * image lives in a temporary directory (-d picks where) and is removed at the
+ * end. The backend, queue depth, cache size... are picked with the usual SFS_*
+ * variables, the config records the backend in use and the queue depth
+ */
+#include "src/disk_emu.h"
+#include "src/sfs_api.h"
+#include "src/sfs_buffer.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FILE_MB 16
+#define DEFAULT_OPS 2000
+#define DEFAULT_FILES 500
+#define DEFAULT_MOUNTS 20
+
+static const int io_sizes[] = {512, 4096, 65536, 1048576};
+
+static long file_bytes;
+static int random_ops;
+static int file_count;
+static int mount_count;
+
+static long *latencies;
+static int latency_count;
+static disk_stats disk_before;
+static buffer_cache_stats cache_before;
+static sfs_counters counters_before;
+static long phase_start;
+static bool first_result = true;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * A phase measures one operation: its latencies, wall time and the block I/O
+ * it caused
+ */
+static void begin_phase(int ops) {
+    free(latencies);
+    latencies = malloc(sizeof(long) * (ops > 0 ? ops : 1));
+    latency_count = 0;
+    disk_get_stats(&disk_before);
+    buffer_cache_get_stats(&cache_before);
+    counters_before = counters;
+    phase_start = now_ns();
+}
+
+static void record(long start) {
+    latencies[latency_count++] = now_ns() - start;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(double p) {
+    return latencies[(long)(p * (latency_count - 1))];
+}
+
+static double per_op(long value) {
+    return latency_count > 0 ? (double)value / latency_count : 0;
+}
+
+static void end_phase(const char *name, int io_size, long bytes) {
+    double seconds = (now_ns() - phase_start) / 1e9;
+    disk_stats disk;
+    buffer_cache_stats cache;
+    disk_get_stats(&disk);
+    buffer_cache_get_stats(&cache);
+
+    long total = 0;
+    for (int i = 0; i < latency_count; i++)
+        total += latencies[i];
+    qsort(latencies, latency_count, sizeof(long), compare_long);
+    if (latency_count == 0)
+        latencies[latency_count++] = 0;
+
+    printf("%s\n    {\"name\": \"%s\", \"io_size\": %d, \"ops\": %d, "
+           "\"bytes\": %ld, \"seconds\": %.6f,\n",
+           first_result ? "" : ",", name, io_size, latency_count, bytes,
+           seconds);
+    printf("     \"ops_per_s\": %.1f, \"mb_per_s\": %.2f,\n",
+           latency_count / seconds, bytes / seconds / (1 << 20));
+    printf("     \"latency_ns\": {\"mean\": %ld, \"p50\": %ld, \"p99\": %ld, "
+           "\"p999\": %ld, \"max\": %ld},\n",
+           total / latency_count, percentile(0.5), percentile(0.99),
+           percentile(0.999), latencies[latency_count - 1]);
+    printf("     \"disk_per_op\": {\"read_requests\": %.3f, "
+           "\"write_requests\": %.3f, \"blocks_read\": %.3f, "
+           "\"blocks_written\": %.3f, \"syncs\": %.3f},\n",
+           per_op(disk.read_requests - disk_before.read_requests),
+           per_op(disk.write_requests - disk_before.write_requests),
+           per_op(disk.blocks_read - disk_before.blocks_read),
+           per_op(disk.blocks_written - disk_before.blocks_written),
+           per_op(disk.syncs - disk_before.syncs));
+    printf("     \"cache_per_op\": {\"hits\": %.3f, \"misses\": %.3f},\n",
+           per_op(cache.hits - cache_before.hits),
+           per_op(cache.misses - cache_before.misses));
+    printf("     \"meta_per_op\": {\"dir_block_syncs\": %.3f, "
+           "\"inode_syncs\": %.3f, \"journal_blocks\": %.3f}}",
+           per_op(counters.dir_block_syncs - counters_before.dir_block_syncs),
+           per_op(counters.inode_syncs - counters_before.inode_syncs),
+           per_op(counters.journal_blocks - counters_before.journal_blocks));
+    first_result = false;
+    fprintf(stderr, "%-14s %8d B %8d ops %10.2f MB/s p50 %ld ns\n", name,
+            io_size, latency_count, bytes / seconds / (1 << 20),
+            percentile(0.5));
+}
+
+static void remount(void) {
+    sfs_unmount();
+    mksfs(0);
+}
+
+static void fill(char *buf, int length, long offset) {
+    for (int i = 0; i < length; i++)
+        buf[i] = (char)('a' + (offset + i) % 26);
+}
+
+static void bench_io(int io_size) {
+    char *buf = malloc(io_size);
+    long ops = file_bytes / io_size;
+    char name[] = "bench";
+
+    // sequential write of a new file, the final sync is part of the time
+    int fd = sfs_fopen(name);
+    begin_phase(ops);
+    for (long i = 0; i < ops; i++) {
+        fill(buf, io_size, i * io_size);
+        long start = now_ns();
+        if (sfs_fwrite(fd, buf, io_size) != io_size) {
+            fprintf(stderr, "write failed at %ld\n", i * io_size);
+            exit(EXIT_FAILURE);
+        }
+        record(start);
+    }
+    sfs_sync();
+    end_phase("seq_write", io_size, ops * io_size);
+    sfs_fclose(fd);
+
+    // reads start from a cold buffer cache
+    remount();
+    fd = sfs_fopen(name);
+    begin_phase(ops);
+    for (long i = 0; i < ops; i++) {
+        long start = now_ns();
+        if (sfs_pread(fd, buf, io_size, i * io_size) != io_size) {
+            fprintf(stderr, "read failed at %ld\n", i * io_size);
+            exit(EXIT_FAILURE);
+        }
+        record(start);
+    }
+    end_phase("seq_read", io_size, ops * io_size);
+    sfs_fclose(fd);
+
+    remount();
+    fd = sfs_fopen(name);
+    begin_phase(random_ops);
+    for (int i = 0; i < random_ops; i++) {
+        long offset = (long)(rand() % ops) * io_size;
+        long start = now_ns();
+        sfs_pread(fd, buf, io_size, offset);
+        record(start);
+    }
+    end_phase("rand_read", io_size, (long)random_ops * io_size);
+
+    begin_phase(random_ops);
+    for (int i = 0; i < random_ops; i++) {
+        long offset = (long)(rand() % ops) * io_size;
+        fill(buf, io_size, offset);
+        long start = now_ns();
+        sfs_pwrite(fd, buf, io_size, offset);
+        record(start);
+    }
+    sfs_sync();
+    end_phase("rand_write", io_size, (long)random_ops * io_size);
+
+    sfs_fclose(fd);
+    sfs_remove(name);
+    sfs_sync();
+    free(buf);
+}
+
+static void file_name(char *name, int i) { sprintf(name, "file%d", i); }
+
+static void bench_files(void) {
+    char name[MAXFILENAME + 1];
+
+    begin_phase(file_count);
+    for (int i = 0; i < file_count; i++) {
+        file_name(name, i);
+        long start = now_ns();
+        sfs_fclose(sfs_fopen(name));
+        record(start);
+    }
+    sfs_sync();
+    end_phase("create", 0, 0);
+
+    begin_phase(random_ops);
+    for (int i = 0; i < random_ops; i++) {
+        file_name(name, rand() % file_count);
+        long start = now_ns();
+        sfs_fclose(sfs_fopen(name));
+        record(start);
+    }
+    end_phase("open", 0, 0);
+
+    begin_phase(random_ops);
+    for (int i = 0; i < random_ops; i++) {
+        file_name(name, rand() % file_count);
+        long start = now_ns();
+        sfs_getfilesize(name);
+        record(start);
+    }
+    end_phase("getfilesize", 0, 0);
+
+    // one create and one remove per op, next to the files
+    begin_phase(random_ops);
+    for (int i = 0; i < random_ops; i++) {
+        sprintf(name, "churn%d", i % 1000);
+        long start = now_ns();
+        sfs_fclose(sfs_fopen(name));
+        sfs_remove(name);
+        record(start);
+    }
+    sfs_sync();
+    end_phase("churn", 0, 0);
+
+    // an image with files on it
+    sfs_unmount();
+    begin_phase(mount_count);
+    for (int i = 0; i < mount_count; i++) {
+        long start = now_ns();
+        mksfs(0);
+        record(start);
+        sfs_unmount();
+    }
+    end_phase("mount_existing", 0, 0);
+    mksfs(0);
+
+    begin_phase(file_count);
+    for (int i = 0; i < file_count; i++) {
+        file_name(name, i);
+        long start = now_ns();
+        sfs_remove(name);
+        record(start);
+    }
+    sfs_sync();
+    end_phase("remove", 0, 0);
+}
+
+static void bench_format(void) {
+    sfs_unmount();
+    begin_phase(mount_count);
+    for (int i = 0; i < mount_count; i++) {
+        long start = now_ns();
+        mksfs(1);
+        record(start);
+        sfs_unmount();
+    }
+    end_phase("mount_fresh", 0, 0);
+    mksfs(1);
+}
+
+static void set_default_env(const char *name, long value) {
+    char text[32];
+    sprintf(text, "%ld", value);
+    setenv(name, text, 0);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-s file MiB] [-n random ops] [-f files] "
+            "[-m mounts] [-d dir]\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = ".";
+    file_bytes = (long)DEFAULT_FILE_MB << 20;
+    random_ops = DEFAULT_OPS;
+    file_count = DEFAULT_FILES;
+    mount_count = DEFAULT_MOUNTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:f:m:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            file_bytes = atol(optarg) << 20;
+            break;
+        case 'n':
+            random_ops = atoi(optarg);
+            break;
+        case 'f':
+            file_count = atoi(optarg);
+            break;
+        case 'm':
+            mount_count = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (file_bytes < (1 << 20) || random_ops < 1 || file_count < 1 ||
+        mount_count < 1)
+        usage(argv[0]);
+
+    // room for the file and the files, unless the geometry is given
+    long block_size = DEFAULT_BLOCK_SIZE;
+    if (getenv(BLOCK_SIZE_ENV) != NULL)
+        block_size = atol(getenv(BLOCK_SIZE_ENV));
+    if (block_size < MIN_BLOCK_SIZE)
+        block_size = MIN_BLOCK_SIZE;
+    set_default_env(DATA_BLOCKS_ENV,
+                    file_bytes / block_size * 2 + file_count + 4096);
+    set_default_env(INODE_COUNT_ENV, file_count + 2);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sfs_bench.XXXXXX", dir);
+    int cwd = open(".", O_RDONLY);
+    if (mkdtemp(path) == NULL || chdir(path) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    srand(1);
+
+    mksfs(1);
+    static const char *backends[] = {"pread", "mmap", "uring"};
+    const char *depth = getenv(DISK_QUEUE_DEPTH_ENV);
+    printf("{\n  \"config\": {\"backend\": \"%s\", \"queue_depth\": %d, "
+           "\"block_size\": %d, \"data_blocks\": %d, \"inode_count\": %d, "
+           "\"file_bytes\": %ld, \"random_ops\": %d, \"files\": %d, "
+           "\"mounts\": %d},\n",
+           backends[get_disk_backend()],
+           depth != NULL ? atoi(depth) : DISK_QUEUE_DEPTH, BLOCK_SIZE,
+           DATA_BLOCK_SIZE, INODE_COUNT, file_bytes, random_ops, file_count,
+           mount_count);
+    printf("  \"results\": [");
+
+    bench_format();
+    for (int i = 0; i < (int)(sizeof(io_sizes) / sizeof(int)); i++)
+        bench_io(io_sizes[i]);
+    bench_files();
+
+    printf("\n  ]\n}\n");
+    sfs_unmount();
+    unlink(DISK_NAME);
+    if (fchdir(cwd) == 0)
+        rmdir(path);
+    close(cwd);
+    free(latencies);
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * Regression tests of the sfs_api layer, linked without FUSE (make test).
+ * Each test runs on a fresh disk in a temporary directory (-d picks where)
+ * that is removed at the end. Prints one line per test and exits with the
+ * number of failures
+ */
+#include "src/disk_emu.h"
+#include "src/sfs_api.h"
+#include "src/sfs_buffer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHECK(condition)                                                       \
+    do {                                                                       \
+        if (!(condition)) {                                                    \
+            fprintf(stderr, "  %s:%d: %s\n", __FILE__, __LINE__, #condition);  \
+            return false;                                                      \
+        }                                                                      \
+    } while (0)
+
+/*
+ * A file removed while open keeps its inode until the last close: a file
+ * created meanwhile gets another inode and fd, and the old fd still reads
+ * and writes the removed file
+ */
+static bool test_unlink_open(void) {
+    char buf[8];
+    int a = sfs_fopen("/A");
+    CHECK(a >= 0);
+    CHECK(sfs_pwrite(a, "aaaa", 4, 0) == 4);
+    CHECK(sfs_remove("/A") == 0);
+    CHECK(sfs_getfilesize("/A") == -1);
+
+    int b = sfs_fopen("/B");
+    CHECK(b >= 0 && b != a);
+    CHECK(sfs_pwrite(a, "AAAAAA", 6, 0) == 6);
+    CHECK(sfs_pread(a, buf, 8, 0) == 6 && memcmp(buf, "AAAAAA", 6) == 0);
+    CHECK(sfs_getfilesize("/B") == 0);
+
+    // the last close frees the inode, /B stays open
+    CHECK(sfs_fclose(a) == 0);
+    CHECK(sfs_pwrite(b, "bb", 2, 0) == 2);
+    CHECK(sfs_getfilesize("/B") == 2);
+    CHECK(sfs_fclose(b) == 0);
+
+    // reopening the name makes a new empty file
+    a = sfs_fopen("/A");
+    CHECK(a >= 0 && sfs_getfilesize("/A") == 0);
+    CHECK(sfs_fclose(a) == 0);
+    CHECK(sfs_remove("/A") == 0 && sfs_remove("/B") == 0);
+    return true;
+}
+
+/*
+ * Every open of a file gets its own fd: two readers going through the file
+ * side by side each keep their pointer and their readahead window
+ */
+static bool test_separate_opens(void) {
+    static char data[256 * 1024];
+    char back[4096];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = (char)(i * 13 + i / 4096);
+    int fd = sfs_fopen("/shared");
+    CHECK(fd >= 0 && sfs_fwrite(fd, data, sizeof(data)) == sizeof(data));
+    CHECK(sfs_fclose(fd) == 0);
+    sfs_unmount();
+    mksfs(0);
+
+    int a = sfs_fopen("/shared");
+    int b = sfs_fopen("/shared");
+    CHECK(a >= 0 && b >= 0 && a != b);
+    CHECK(sfs_fseek(a, 0) == 0 && sfs_fseek(b, 0) == 0);
+    buffer_cache_stats before, after;
+    buffer_cache_get_stats(&before);
+    for (int offset = 0; offset < (int)sizeof(data); offset += 4096) {
+        CHECK(sfs_fread(a, back, 4096) == 4096);
+        CHECK(memcmp(back, data + offset, 4096) == 0);
+        CHECK(sfs_fread(b, back, 4096) == 4096);
+        CHECK(memcmp(back, data + offset, 4096) == 0);
+    }
+    buffer_cache_get_stats(&after);
+    CHECK(after.readahead_hits - before.readahead_hits > 0);
+    CHECK(sfs_fclose(a) == 0 && sfs_fclose(b) == 0);
+    return true;
+}
+
+/*
+ * An orphan left open at unmount (a crash) is freed by the next mount
+ */
+static bool test_orphan_mount(void) {
+    long before = 0;
+    char name[MAXFILENAME + 1];
+    while (sfs_getnextfilename(name))
+        before++;
+    int fd = sfs_fopen("/orphan");
+    CHECK(fd >= 0);
+    CHECK(sfs_pwrite(fd, "data", 4, 0) == 4);
+    CHECK(sfs_remove("/orphan") == 0);
+    sfs_unmount();
+    mksfs(0);
+
+    // every inode is free again: as many files as before can be created
+    int created = 0;
+    while (created < INODE_COUNT) {
+        sprintf(name, "f%d", created);
+        fd = sfs_fopen(name);
+        if (fd < 0)
+            break;
+        sfs_fclose(fd);
+        created++;
+    }
+    CHECK(created + before == INODE_COUNT - 1);
+    for (int i = 0; i < created; i++) {
+        sprintf(name, "f%d", i);
+        CHECK(sfs_remove(name) == 0);
+    }
+    return true;
+}
+
+static bool test_seek(void) {
+    int fd = sfs_fopen("/seek");
+    CHECK(fd >= 0);
+    CHECK(sfs_fseek(fd, -1) == -1 && errno == EINVAL);
+    CHECK(sfs_fseek(fd, 3) == 0);
+    CHECK(sfs_fwrite(fd, "x", 1) == 1);
+    CHECK(sfs_getfilesize("/seek") == 4);
+    CHECK(sfs_fclose(fd) == 0 && sfs_remove("/seek") == 0);
+    return true;
+}
+
+/*
+ * A write, truncate and remove of a file larger than a journal transaction
+ * run in steps. The space of the removed file is found again by the next
+ * write, whose allocation takes the freed blocks once their free commits
+ */
+static bool test_large_file(void) {
+    long size = 20L * 1024 * 1024;
+    char *data = malloc(size);
+    char *back = malloc(size);
+    for (long i = 0; i < size; i++)
+        data[i] = (char)(i * 7 + i / 4096);
+    for (int round = 0; round < 2; round++) {
+        int fd = sfs_fopen("/large");
+        CHECK(fd >= 0);
+        CHECK(sfs_pwrite(fd, data, (int)size, 0) == size);
+        CHECK(sfs_truncate("/large", size / 3 + 5) == 0);
+        CHECK(sfs_pread(fd, back, (int)size, 0) == size / 3 + 5);
+        CHECK(memcmp(data, back, size / 3 + 5) == 0);
+        CHECK(sfs_fclose(fd) == 0 && sfs_remove("/large") == 0);
+    }
+    free(data);
+    free(back);
+    return true;
+}
+
+/*
+ * Creates in the middle of a listing split the leaf being listed, every
+ * entry there from the start is still listed once
+ */
+static bool test_readdir_split(void) {
+    int seen[30] = {0};
+    char name[MAXFILENAME + 1];
+    for (int i = 0; i < 30; i++) {
+        sprintf(name, "/old%d", i);
+        int fd = sfs_fopen(name);
+        CHECK(fd >= 0 && sfs_fclose(fd) == 0);
+    }
+    sfs_dirent page[5];
+    long cookie = 0;
+    int count;
+    bool created = false;
+    while ((count = sfs_readdir("/", cookie, page, 5)) > 0) {
+        for (int i = 0; i < count; i++) {
+            int index;
+            if (sscanf(page[i].name, "old%d", &index) == 1)
+                seen[index]++;
+        }
+        cookie = page[count - 1].cookie;
+        // more than a leaf holds, a split is forced
+        for (int i = 0; !created && i < 30; i++) {
+            sprintf(name, "/new%d", i);
+            int fd = sfs_fopen(name);
+            CHECK(fd >= 0 && sfs_fclose(fd) == 0);
+        }
+        created = true;
+    }
+    for (int i = 0; i < 30; i++)
+        CHECK(seen[i] == 1);
+    return true;
+}
+
+/*
+ * A full disk fails buffered writes with ENOSPC when they are made: every
+ * write that was accepted is in the file after close, none is dropped by a
+ * flush that finds no space
+ */
+static bool test_full_disk(void) {
+    setenv(DATA_BLOCKS_ENV, "3000", 1);
+    sfs_unmount();
+    mksfs(1);
+    unsetenv(DATA_BLOCKS_ENV);
+
+    static char buf[1024 * 1024];
+    memset(buf, 'f', sizeof(buf));
+    int fd = sfs_fopen("/full");
+    CHECK(fd >= 0);
+    long size = 0;
+    int written;
+    while ((written = sfs_fwrite(fd, buf, sizeof(buf))) > 0)
+        size += written;
+    CHECK(errno == ENOSPC);
+    while ((written = sfs_fwrite(fd, buf, 1024)) == 1024)
+        size += written;
+    CHECK(written == -1 && errno == ENOSPC);
+    CHECK(sfs_fclose(fd) == 0);
+    CHECK(sfs_getfilesize("/full") == size);
+    return true;
+}
+
+static volatile bool writers_stop;
+
+static void *writer(void *arg) {
+    char name[16];
+    char buf[6000];
+    sprintf(name, "/w%ld", (long)arg);
+    memset(buf, 'w', sizeof(buf));
+    int fd = sfs_fopen(name);
+    long offset = 0;
+    while (!writers_stop && fd >= 0) {
+        sfs_pwrite(fd, buf, sizeof(buf), offset);
+        offset = (offset + sizeof(buf)) % (1024 * 1024);
+    }
+    sfs_fclose(fd);
+    return NULL;
+}
+
+/*
+ * Operations that always overlap still let the timer commit: a wanted commit
+ * holds back new operations until the running ones end
+ */
+static bool test_commit_under_load(void) {
+    setenv(JOURNAL_COMMIT_ENV, "10", 1);
+    sfs_unmount();
+    mksfs(0);
+    unsetenv(JOURNAL_COMMIT_ENV);
+
+    long commits = counters.journal_commits;
+    pthread_t threads[4];
+    writers_stop = false;
+    for (long i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, writer, (void *)i);
+    struct timespec load = {0, 300000000};
+    nanosleep(&load, NULL);
+    writers_stop = true;
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    CHECK(counters.journal_commits - commits >= 5);
+    return true;
+}
+
+static const struct {
+    const char *name;
+    bool (*run)(void);
+} tests[] = {
+    {"unlink_open", test_unlink_open},
+    {"separate_opens", test_separate_opens},
+    {"orphan_mount", test_orphan_mount},
+    {"seek", test_seek},
+    {"readdir_split", test_readdir_split},
+    {"large_file", test_large_file},
+    {"full_disk", test_full_disk},
+    {"commit_under_load", test_commit_under_load},
+};
+
+int main(int argc, char **argv) {
+    const char *dir = ".";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt != 'd') {
+            fprintf(stderr, "usage: %s [-d dir]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        dir = optarg;
+    }
+
+    // small enough to run out of inodes quickly
+    setenv(INODE_COUNT_ENV, "64", 0);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sfs_test.XXXXXX", dir);
+    int cwd = open(".", O_RDONLY);
+    if (mkdtemp(path) == NULL || chdir(path) < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    for (int i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+        mksfs(1);
+        bool passed = tests[i].run();
+        sfs_unmount();
+        printf("%-20s %s\n", tests[i].name, passed ? "ok" : "FAILED");
+        if (!passed)
+            failures++;
+    }
+
+    unlink(DISK_NAME);
+    if (fchdir(cwd) == 0)
+        rmdir(path);
+    close(cwd);
+    return failures;
+}
@@ -1,21 +1,215 @@
+#define _GNU_SOURCE
 #include "disk_emu.h"
+#include "disk_mmap.h"
+#include "disk_uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-FILE *fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int fd = -1;
+static int backend = DISK_BACKEND_PREAD;
+static int mapped = 0;
+static int ringed = 0;
+static int queue_depth = 32;
+static disk_stats stats;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*----------------------------------------------------------*/
+/*Counts a request, the disk has no lock of its own          */
+/*----------------------------------------------------------*/
+static void count_io(int write, long nblocks) {
+    if (write) {
+        __atomic_fetch_add(&stats.write_requests, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.blocks_written, nblocks, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&stats.read_requests, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.blocks_read, nblocks, __ATOMIC_RELAXED);
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Checks that the blocks requested are within the disk       */
+/*----------------------------------------------------------*/
+static int check_bounds(int start_address, int nblocks) {
+    if (fd < 0 || start_address < 0 || nblocks < 0 ||
+        start_address + nblocks > MAX_BLOCK) {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Moves a vector forward by the number of bytes transferred  */
+/*----------------------------------------------------------*/
+static void advance_iov(struct iovec **iov, int *iovcnt, size_t done) {
+    while (*iovcnt > 0 && done >= (*iov)->iov_len) {
+        done -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Transfers a whole vector at the given offset. Retries on   */
+/*short transfers, reads past the end of the file are zeroed */
+/*----------------------------------------------------------*/
+static int transfer_iov(int write, struct iovec *iov, int iovcnt,
+                        off_t offset) {
+    while (iovcnt > 0) {
+        int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t done;
+        if (count == 1)
+            done = write ? pwrite(fd, iov->iov_base, iov->iov_len, offset)
+                         : pread(fd, iov->iov_base, iov->iov_len, offset);
+        else
+            done = write ? pwritev(fd, iov, count, offset)
+                         : preadv(fd, iov, count, offset);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("disk io");
+            return -1;
+        }
+        if (done == 0) {
+            if (write)
+                return -1;
+            /*End of the disk file, the rest reads as 0's*/
+            for (int i = 0; i < iovcnt; i++)
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            return 0;
+        }
+        offset += done;
+        advance_iov(&iov, &iovcnt, (size_t)done);
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Maps the open disk or sets up the io_uring rings when that */
+/*backend is selected, falls back to pread/pwrite if it fails*/
+/*----------------------------------------------------------*/
+static void open_backend(void) {
+    mapped = 0;
+    ringed = 0;
+    if (backend == DISK_BACKEND_MMAP && map_disk(fd, BLOCK_SIZE, MAX_BLOCK) == 0)
+        mapped = 1;
+    if (backend == DISK_BACKEND_URING && uring_open(fd, queue_depth) == 0)
+        ringed = 1;
+}
+
+/*----------------------------------------------------------*/
+/*The backend the open disk really uses, after any fallback  */
+/*----------------------------------------------------------*/
+int get_disk_backend(void) {
+    if (mapped)
+        return DISK_BACKEND_MMAP;
+    return ringed ? DISK_BACKEND_URING : DISK_BACKEND_PREAD;
+}
+
+/*----------------------------------------------------------*/
+/*Selects the backend used by the next init (mount time)     */
+/*----------------------------------------------------------*/
+int set_disk_backend(int disk_backend) {
+    backend = disk_backend;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Sets how many requests of a batch the io_uring backend     */
+/*keeps in flight (next init)                                */
+/*----------------------------------------------------------*/
+int set_disk_queue_depth(int depth) {
+    queue_depth = depth;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Returns a pointer to a block of the disk, NULL if the      */
+/*backend cannot hand out block pointers                     */
+/*----------------------------------------------------------*/
+void *block_pointer(int address) {
+    if (!mapped || check_bounds(address, 1) < 0)
+        return NULL;
+    return mapped_block(address);
+}
+
+/*----------------------------------------------------------*/
+/*Writes 0's over a series of blocks                         */
+/*----------------------------------------------------------*/
+int zero_blocks(int start_address, int nblocks) {
+    if (check_bounds(start_address, nblocks) < 0)
+        return -1;
+    char *zero = calloc(1, BLOCK_SIZE);
+    int status = nblocks;
+    for (int i = 0; i < nblocks; i++) {
+        if (write_blocks(start_address + i, 1, zero) < 0) {
+            status = -1;
+            break;
+        }
+    }
+    free(zero);
+    return status;
+}
+
+/*----------------------------------------------------------*/
+/*Drops the content of a series of blocks by punching a hole */
+/*in the disk file, falls back to writing 0's when the file  */
+/*system does not support it                                 */
+/*----------------------------------------------------------*/
+int discard_blocks(int start_address, int nblocks) {
+    if (check_bounds(start_address, nblocks) < 0)
+        return -1;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)start_address * BLOCK_SIZE,
+                  (off_t)nblocks * BLOCK_SIZE) == 0)
+        return nblocks;
+#endif
+    return zero_blocks(start_address, nblocks);
+}
+
+/*----------------------------------------------------------*/
+/*Makes everything written so far durable                    */
+/*----------------------------------------------------------*/
+int sync_disk(void) {
+    __atomic_fetch_add(&stats.syncs, 1, __ATOMIC_RELAXED);
+    if (mapped)
+        return sync_mapped_disk();
+    if (fd >= 0)
+        return fsync(fd);
+    return 0;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk(void) {
-    if (NULL != fp) {
-        fclose(fp);
+    if (mapped) {
+        unmap_disk();
+        mapped = 0;
+    }
+    if (ringed) {
+        uring_close();
+        ringed = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
     }
     return 0;
 }
@@ -24,27 +218,25 @@ int close_disk(void) {
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks) {
-    int i, j;
-
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
 
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time(0)));
     /*Creates a new file*/
-    fp = fopen(filename, "w+b");
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
 
-    if (fp == NULL) {
+    if (fd < 0) {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
 
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++) {
-        for (j = 0; j < BLOCK_SIZE; j++) {
-            fputc(0, fp);
-        }
+    /*Sizes the file, the blocks read as 0's until they are written*/
+    if (ftruncate(fd, (off_t)BLOCK_SIZE * MAX_BLOCK) < 0) {
+        printf("Could not size disk file %s\n\n", filename);
+        close(fd);
+        fd = -1;
+        return -1;
     }
+    open_backend();
     return 0;
 }
 /*----------------------------*/
@@ -55,12 +247,13 @@ int init_disk(char *filename, int block_size, int num_blocks) {
     MAX_BLOCK = num_blocks;
 
     /*Opens a file*/
-    fp = fopen(filename, "r+b");
+    fd = open(filename, O_RDWR);
 
-    if (fp == NULL) {
+    if (fd < 0) {
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+    open_backend();
     return 0;
 }
 
@@ -68,63 +261,174 @@ int init_disk(char *filename, int block_size, int num_blocks) {
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer) {
-    int i, s;
-    s = 0;
+    if (check_bounds(start_address, nblocks) < 0)
+        return -1;
+    count_io(0, nblocks);
+    if (mapped)
+        return mapped_read_blocks(start_address, nblocks, buffer);
 
-    /*Sets up a temporary buffer*/
-    void *blockRead = (void *)malloc(BLOCK_SIZE);
+    struct iovec iov = {buffer, (size_t)nblocks * BLOCK_SIZE};
+    if (transfer_iov(0, &iov, 1, (off_t)start_address * BLOCK_SIZE) < 0)
+        return -1;
+    return nblocks;
+}
 
-    /*Checks that the data requested is within the range of addresses of the
-     * disk*/
-    if (start_address + nblocks > MAX_BLOCK) {
-        printf("out of bound error %d\n", start_address);
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer) {
+    if (check_bounds(start_address, nblocks) < 0)
         return -1;
-    }
+    count_io(1, nblocks);
+    if (mapped)
+        return mapped_write_blocks(start_address, nblocks, buffer);
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    struct iovec iov = {buffer, (size_t)nblocks * BLOCK_SIZE};
+    if (transfer_iov(1, &iov, 1, (off_t)start_address * BLOCK_SIZE) < 0)
+        return -1;
+    return nblocks;
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i) {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer + (i * BLOCK_SIZE), blockRead, BLOCK_SIZE);
+/*-------------------------------------------------------------------*/
+/*Reads a series of consecutive blocks, one block per buffer         */
+/*-------------------------------------------------------------------*/
+int readv_blocks(int start_address, int nblocks, void **buffers) {
+    if (check_bounds(start_address, nblocks) < 0)
+        return -1;
+    if (nblocks == 0)
+        return 0;
+    count_io(0, nblocks);
+    if (mapped) {
+        for (int i = 0; i < nblocks; i++)
+            mapped_read_blocks(start_address + i, 1, buffers[i]);
+        return nblocks;
     }
 
-    free(blockRead);
-    return s;
+    struct iovec iov[nblocks];
+    for (int i = 0; i < nblocks; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    if (transfer_iov(0, iov, nblocks, (off_t)start_address * BLOCK_SIZE) < 0)
+        return -1;
+    return nblocks;
 }
 
 /*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
+/*Writes a series of consecutive blocks, one block per buffer       */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer) {
-    int i, s;
-    s = 0;
-
-    void *blockWrite = (void *)malloc(BLOCK_SIZE);
+int writev_blocks(int start_address, int nblocks, void **buffers) {
+    if (check_bounds(start_address, nblocks) < 0)
+        return -1;
+    if (nblocks == 0)
+        return 0;
+    count_io(1, nblocks);
+    if (mapped) {
+        for (int i = 0; i < nblocks; i++)
+            mapped_write_blocks(start_address + i, 1, buffers[i]);
+        return nblocks;
+    }
 
-    /*Checks that the data requested is within the range of addresses of the
-     * disk*/
-    if (start_address + nblocks > MAX_BLOCK) {
-        printf("out of bound error\n");
+    struct iovec iov[nblocks];
+    for (int i = 0; i < nblocks; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    if (transfer_iov(1, iov, nblocks, (off_t)start_address * BLOCK_SIZE) < 0)
         return -1;
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Moves a batch of block runs (anywhere on the disk). The io_uring  */
+/*backend keeps them in flight together, the other backends run them*/
+/*one after the other, merging runs that follow each other on the   */
+/*disk into one vectored transfer                                   */
+/*------------------------------------------------------------------*/
+static int transfer_batch(int write, disk_request *requests, int count) {
+    for (int i = 0; i < count; i++) {
+        if (check_bounds(requests[i].address, requests[i].nblocks) < 0)
+            return -1;
+    }
+    if (count == 0)
+        return 0;
+    for (int i = 0; i < count; i++)
+        count_io(write, requests[i].nblocks);
+    if (mapped) {
+        for (int i = 0; i < count; i++) {
+            if (write)
+                mapped_write_blocks(requests[i].address, requests[i].nblocks,
+                                    requests[i].buffer);
+            else
+                mapped_read_blocks(requests[i].address, requests[i].nblocks,
+                                   requests[i].buffer);
+        }
+        return count;
     }
+    if (ringed && uring_transfer(write, requests, count, BLOCK_SIZE) == 0)
+        return count;
 
-    /*Goto where the data is to be written on the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    struct iovec iov[count];
+    int i = 0;
+    while (i < count) {
+        int run = 0;
+        int end = requests[i].address;
+        while (i + run < count && requests[i + run].address == end) {
+            iov[run].iov_base = requests[i + run].buffer;
+            iov[run].iov_len = (size_t)requests[i + run].nblocks * BLOCK_SIZE;
+            end += requests[i + run].nblocks;
+            run++;
+        }
+        if (transfer_iov(write, iov, run,
+                         (off_t)requests[i].address * BLOCK_SIZE) < 0)
+            return -1;
+        i += run;
+    }
+    return count;
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i) {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+int read_blocks_batch(disk_request *requests, int count) {
+    return transfer_batch(0, requests, count);
+}
 
-        memcpy(blockWrite, (char *)buffer + (i * BLOCK_SIZE), BLOCK_SIZE);
+int write_blocks_batch(disk_request *requests, int count) {
+    return transfer_batch(1, requests, count);
+}
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-    return s;
+/*------------------------------------------------------------------*/
+/*Registers a long lived buffer (the block cache) with the io_uring */
+/*backend so transfers in and out of it skip page pinning           */
+/*------------------------------------------------------------------*/
+int register_disk_buffer(void *buffer, size_t size) {
+    if (!ringed)
+        return -1;
+    return uring_register_buffer(buffer, size);
+}
+
+int unregister_disk_buffer(void) {
+    if (!ringed)
+        return 0;
+    return uring_unregister_buffer();
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the block I/O counters                                     */
+/*------------------------------------------------------------------*/
+void disk_get_stats(disk_stats *out) {
+    out->read_requests =
+        __atomic_load_n(&stats.read_requests, __ATOMIC_RELAXED);
+    out->write_requests =
+        __atomic_load_n(&stats.write_requests, __ATOMIC_RELAXED);
+    out->blocks_read = __atomic_load_n(&stats.blocks_read, __ATOMIC_RELAXED);
+    out->blocks_written =
+        __atomic_load_n(&stats.blocks_written, __ATOMIC_RELAXED);
+    out->syncs = __atomic_load_n(&stats.syncs, __ATOMIC_RELAXED);
+}
+
+void disk_reset_stats(void) {
+    __atomic_store_n(&stats.read_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.write_requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.syncs, 0, __ATOMIC_RELAXED);
 }
@@ -1,5 +1,47 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#define DISK_BACKEND_PREAD 0
+#define DISK_BACKEND_MMAP 1
+#define DISK_BACKEND_URING 2
+
+#include <stddef.h>
+
+/*A run of consecutive blocks and its buffer, one entry of a batch*/
+typedef struct {
+    int address;
+    int nblocks;
+    void *buffer;
+} disk_request;
+
+/*Block I/O counters, requests are the calls that reached the disk*/
+typedef struct {
+    long read_requests;
+    long write_requests;
+    long blocks_read;
+    long blocks_written;
+    long syncs;
+} disk_stats;
+
+int set_disk_backend(int disk_backend);
+int get_disk_backend(void);
+int set_disk_queue_depth(int queue_depth);
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int readv_blocks(int start_address, int nblocks, void **buffers);
+int writev_blocks(int start_address, int nblocks, void **buffers);
+int read_blocks_batch(disk_request *requests, int count);
+int write_blocks_batch(disk_request *requests, int count);
+int register_disk_buffer(void *buffer, size_t size);
+int unregister_disk_buffer(void);
+int zero_blocks(int start_address, int nblocks);
+int discard_blocks(int start_address, int nblocks);
 int close_disk(void);
+void *block_pointer(int address);
+int sync_disk(void);
+void disk_get_stats(disk_stats *stats);
+void disk_reset_stats(void);
+
+#endif
@@ -0,0 +1,83 @@
+#include "disk_mmap.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char *map = NULL;
+static size_t map_size;
+static int map_block_size;
+
+/*----------------------------------------------------------*/
+/*Maps the whole disk file, growing it to its size if needed */
+/*----------------------------------------------------------*/
+int map_disk(int fd, int block_size, int num_blocks) {
+    struct stat st;
+
+    map_block_size = block_size;
+    map_size = (size_t)block_size * num_blocks;
+
+    if (fstat(fd, &st) < 0 ||
+        ((size_t)st.st_size < map_size && ftruncate(fd, map_size) < 0)) {
+        perror("map disk");
+        return -1;
+    }
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("map disk");
+        map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*-------------------------------------------------*/
+/*Writes the mapped image back and removes the map */
+/*-------------------------------------------------*/
+int unmap_disk(void) {
+    if (map == NULL)
+        return 0;
+    sync_mapped_disk();
+    munmap(map, map_size);
+    map = NULL;
+    return 0;
+}
+
+/*-------------------------------------------------------*/
+/*Returns a pointer to a block of the image, NULL if the */
+/*disk is not mapped                                     */
+/*-------------------------------------------------------*/
+void *mapped_block(int address) {
+    if (map == NULL)
+        return NULL;
+    return map + (size_t)address * map_block_size;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the mapped image into the buffer     */
+/*-------------------------------------------------------------------*/
+int mapped_read_blocks(int start_address, int nblocks, void *buffer) {
+    memcpy(buffer, mapped_block(start_address),
+           (size_t)nblocks * map_block_size);
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks from the buffer into the mapped image   */
+/*------------------------------------------------------------------*/
+int mapped_write_blocks(int start_address, int nblocks, void *buffer) {
+    memcpy(mapped_block(start_address), buffer,
+           (size_t)nblocks * map_block_size);
+    return nblocks;
+}
+
+/*-----------------------------------------------*/
+/*Makes the mapped image durable (explicit sync) */
+/*-----------------------------------------------*/
+int sync_mapped_disk(void) {
+    if (map == NULL)
+        return 0;
+    return msync(map, map_size, MS_SYNC);
+}
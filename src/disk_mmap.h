@@ -0,0 +1,6 @@
+int map_disk(int fd, int block_size, int num_blocks);
+int unmap_disk(void);
+void *mapped_block(int address);
+int mapped_read_blocks(int start_address, int nblocks, void *buffer);
+int mapped_write_blocks(int start_address, int nblocks, void *buffer);
+int sync_mapped_disk(void);
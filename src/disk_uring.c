@@ -0,0 +1,338 @@
+#include "disk_uring.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*Rings shared by the threads, a batch takes a free one and  */
+/*goes through the synchronous path when they are all busy   */
+#define RING_COUNT 4
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    pthread_mutex_t lock;
+} ring;
+
+static ring rings[RING_COUNT];
+static int ring_count = 0;
+static int disk_fd = -1;
+static int depth;
+static struct iovec registered = {NULL, 0};
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void unmap_ring(ring *r) {
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring != NULL)
+        munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close(r->fd);
+}
+
+/*----------------------------------------------------------*/
+/*Creates a ring and maps its queues, the disk file is       */
+/*registered so requests skip the file table lookup          */
+/*----------------------------------------------------------*/
+static int open_ring(ring *r) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = ring_setup(depth, &params);
+    if (r->fd < 0)
+        return -1;
+
+    r->entries = params.sq_entries;
+    r->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        unmap_ring(r);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            unmap_ring(r);
+            return -1;
+        }
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        unmap_ring(r);
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (ring_register(r->fd, IORING_REGISTER_FILES, &disk_fd, 1) < 0) {
+        unmap_ring(r);
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    return 0;
+}
+
+static void register_ring_buffer(ring *r) {
+    if (registered.iov_base != NULL &&
+        ring_register(r->fd, IORING_REGISTER_BUFFERS, &registered, 1) < 0)
+        registered.iov_base = NULL;
+}
+
+static void close_rings(void) {
+    for (int i = 0; i < ring_count; i++) {
+        unmap_ring(&rings[i]);
+        pthread_mutex_destroy(&rings[i].lock);
+    }
+    ring_count = 0;
+}
+
+static int open_rings(void) {
+    for (int i = 0; i < RING_COUNT; i++) {
+        if (open_ring(&rings[i]) < 0)
+            break;
+        ring_count++;
+    }
+    for (int i = 0; i < ring_count; i++)
+        register_ring_buffer(&rings[i]);
+    return ring_count > 0 ? 0 : -1;
+}
+
+/*----------------------------------------------------------*/
+/*A ring is tied to the process that created it and its      */
+/*registered buffer pins the parent's pages: hold the rings  */
+/*across a fork and build new ones in the child              */
+/*----------------------------------------------------------*/
+static void uring_before_fork(void) {
+    pthread_mutex_lock(&rings_lock);
+    for (int i = 0; i < ring_count; i++)
+        pthread_mutex_lock(&rings[i].lock);
+}
+
+static void uring_after_fork_parent(void) {
+    for (int i = 0; i < ring_count; i++)
+        pthread_mutex_unlock(&rings[i].lock);
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void uring_after_fork_child(void) {
+    for (int i = 0; i < ring_count; i++)
+        pthread_mutex_unlock(&rings[i].lock);
+    if (ring_count > 0) {
+        close_rings();
+        open_rings();
+    }
+    pthread_mutex_init(&rings_lock, NULL);
+}
+
+/*----------------------------------------------------------*/
+/*Sets up the rings for the disk file, returns -1 when       */
+/*io_uring is not available                                  */
+/*----------------------------------------------------------*/
+int uring_open(int fd, int queue_depth) {
+    static int atfork_registered = 0;
+    if (!atfork_registered) {
+        pthread_atfork(uring_before_fork, uring_after_fork_parent,
+                       uring_after_fork_child);
+        atfork_registered = 1;
+    }
+    pthread_mutex_lock(&rings_lock);
+    close_rings();
+    disk_fd = fd;
+    depth = queue_depth > 0 ? queue_depth : 1;
+    registered.iov_base = NULL;
+    int status = open_rings();
+    pthread_mutex_unlock(&rings_lock);
+    return status;
+}
+
+int uring_close(void) {
+    pthread_mutex_lock(&rings_lock);
+    close_rings();
+    disk_fd = -1;
+    registered.iov_base = NULL;
+    pthread_mutex_unlock(&rings_lock);
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Registers one buffer with every ring, requests that fall   */
+/*inside it use the fixed read/write opcodes (no page pinning*/
+/*per request)                                               */
+/*----------------------------------------------------------*/
+int uring_register_buffer(void *buffer, size_t size) {
+    pthread_mutex_lock(&rings_lock);
+    registered.iov_base = buffer;
+    registered.iov_len = size;
+    for (int i = 0; i < ring_count; i++) {
+        pthread_mutex_lock(&rings[i].lock);
+        register_ring_buffer(&rings[i]);
+        pthread_mutex_unlock(&rings[i].lock);
+    }
+    int status = registered.iov_base != NULL ? 0 : -1;
+    pthread_mutex_unlock(&rings_lock);
+    return status;
+}
+
+int uring_unregister_buffer(void) {
+    pthread_mutex_lock(&rings_lock);
+    if (registered.iov_base != NULL) {
+        for (int i = 0; i < ring_count; i++) {
+            pthread_mutex_lock(&rings[i].lock);
+            ring_register(rings[i].fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+            pthread_mutex_unlock(&rings[i].lock);
+        }
+    }
+    registered.iov_base = NULL;
+    pthread_mutex_unlock(&rings_lock);
+    return 0;
+}
+
+static ring *take_ring(void) {
+    for (int i = 0; i < ring_count; i++) {
+        if (pthread_mutex_trylock(&rings[i].lock) == 0)
+            return &rings[i];
+    }
+    return NULL;
+}
+
+static void prepare_request(ring *r, unsigned index, int write,
+                            disk_request *request, int block_size) {
+    unsigned tail = *r->sq_tail;
+    unsigned slot = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[slot];
+    char *buffer = request->buffer;
+    size_t length = (size_t)request->nblocks * block_size;
+    char *base = registered.iov_base;
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (base != NULL && buffer >= base &&
+        buffer + length <= base + registered.iov_len) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->off = (unsigned long long)request->address * block_size;
+    sqe->user_data = index;
+    r->sq_array[slot] = slot;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*----------------------------------------------------------*/
+/*Keeps up to the queue depth of requests in flight and reaps*/
+/*their completions. Returns -1 when no ring is free or a    */
+/*request failed or came up short, the caller then runs the  */
+/*whole batch synchronously                                  */
+/*----------------------------------------------------------*/
+int uring_transfer(int write, disk_request *requests, int count,
+                   int block_size) {
+    ring *r = take_ring();
+    if (r == NULL)
+        return -1;
+
+    int status = 0;
+    int next = 0;
+    int completed = 0;
+    unsigned queued = 0;
+    unsigned in_flight = 0;
+    while (completed < count) {
+        while (next < count && in_flight + queued < r->entries) {
+            prepare_request(r, next, write, &requests[next], block_size);
+            next++;
+            queued++;
+        }
+
+        int submitted = ring_enter(r->fd, queued, 1);
+        if (submitted < 0) {
+            if (errno == EINTR)
+                continue;
+            // nothing more can complete than what is already in flight
+            if (in_flight == 0) {
+                status = -1;
+                break;
+            }
+            submitted = 0;
+        }
+        queued -= submitted;
+        in_flight += submitted;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            disk_request *request = &requests[cqe->user_data];
+            if (cqe->res != request->nblocks * block_size)
+                status = -1;
+            head++;
+            in_flight--;
+            completed++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // requests the kernel never took are dropped from the queue
+    *r->sq_tail -= queued;
+    pthread_mutex_unlock(&r->lock);
+    return status;
+}
@@ -0,0 +1,9 @@
+#include "disk_emu.h"
+#include <stddef.h>
+
+int uring_open(int fd, int queue_depth);
+int uring_close(void);
+int uring_register_buffer(void *buffer, size_t size);
+int uring_unregister_buffer(void);
+int uring_transfer(int write, disk_request *requests, int count,
+                   int block_size);
@@ -1,204 +1,1042 @@
 #include "sfs_api.h"
+#include "sfs_dir.h"
+#include "sfs_journal.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /*
  * next file name index
- * (for the getnextfilename function)
+ * (for the getnextfilename function, guarded by the directory lock)
  */
-int current_file_name_index;
+long current_file_name_index;
 
 /*
- * Closes the file in the fd_table
+ * Write buffer flusher thread, it empties every write buffer on a timer or
+ * when the pool runs out
  */
-int close_file(int fd) {
-    file_descriptor *_fd = get_fd(fd);
-    if (_fd == NULL)
+static bool flusher_running;
+
+static bool flusher_stop;
+
+static bool flush_wanted;
+
+static int flush_ms;
+
+static pthread_t flusher_thread;
+
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The inodes a flush walks, allocated at the first mount. The flusher, sync
+ * and unmount share it, one flush at a time
+ */
+static int *flush_list;
+
+static pthread_mutex_t flush_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the inode of an open fd, -1 if it is not open
+ */
+static int fd_inode(int _fd) {
+    lock_fd_table();
+    file_descriptor *fd = get_fd(_fd);
+    int inode_index = fd == NULL ? -1 : fd->inode;
+    unlock_fd_table();
+    return inode_index;
+}
+
+/*
+ * Reads or moves the fd pointer (-1 reads it)
+ */
+static long fd_pointer(int _fd, long pointer) {
+    lock_fd_table();
+    file_descriptor *fd = get_fd(_fd);
+    if (pointer >= 0)
+        fd->op_pointer = pointer;
+    pointer = fd->op_pointer;
+    unlock_fd_table();
+    return pointer;
+}
+
+/*
+ * Returns how many blocks starting at index i of blocks (at most max) are
+ * consecutive on the disk
+ */
+static int contiguous_run(const int *blocks, int i, int max) {
+    int run = 1;
+    while (run < max && blocks[i + run] == blocks[i] + run)
+        run++;
+    return run;
+}
+
+/*
+ * Allocates a data block for every hole in blocks (the data blocks of the
+ * file blocks from first on) in one batch of extents, continuing right after
+ * the block before the first hole when possible. Returns the number of new
+ * blocks, -1 if the disk is full
+ */
+static int allocate_holes(inode *file_inode, int first, int *blocks,
+                          int count) {
+    int holes = 0;
+    int goal = -1;
+    for (int i = 0; i < count; ++i) {
+        if (blocks[i] >= 0)
+            continue;
+        if (holes++ > 0)
+            continue;
+        int before = -1;
+        if (i > 0)
+            before = blocks[i - 1];
+        else if (first > 0)
+            map_file_blocks(file_inode, first - 1, 1, &before);
+        goal = before >= 0 ? before + 1 : -1;
+    }
+    if (holes == 0)
+        return 0;
+
+    extent *extents = malloc(sizeof(extent) * holes);
+    int *new_blocks = malloc(sizeof(int) * holes);
+    int extent_count = allocate_extents(goal, holes, extents, holes);
+    int allocated = 0;
+    for (int i = 0; i < extent_count; ++i) {
+        for (int j = 0; j < extents[i].length; ++j) {
+            new_blocks[allocated++] = extents[i].start + j;
+        }
+    }
+    if (allocated < holes) {
+        free_used_blocks(allocated, new_blocks);
+        holes = -1;
+    } else {
+        for (int i = 0, j = 0; i < count; ++i) {
+            if (blocks[i] < 0)
+                blocks[i] = new_blocks[j++];
+        }
+    }
+    free(extents);
+    free(new_blocks);
+    return holes;
+}
+
+/*
+ * Releases the blocks a write allocated that set_file_blocks could not map
+ * (mapped holds the blocks of the file before the write), and the blocks
+ * mapped past the size of the file
+ */
+static void release_unmapped(inode *file_inode, int first, int *blocks,
+                             int *mapped, int count) {
+    int unmapped = 0;
+    map_file_blocks(file_inode, first, count, mapped);
+    for (int i = 0; i < count; ++i) {
+        if (mapped[i] != blocks[i])
+            blocks[unmapped++] = blocks[i];
+    }
+    free_used_blocks(unmapped, blocks);
+    free_file_blocks(file_inode,
+                     (int)divide_round_up(file_inode->size, BLOCK_SIZE));
+}
+
+/*
+ * Writes into the file of an inode at the given offset, returns the number of
+ * bytes written. The data goes to the disk before the new blocks are mapped
+ */
+static int write_inode_data(int inode_index, const char *_buf, int _length,
+                            long offset) {
+    inode *file_inode = get_inode(inode_index);
+
+    // byte range of the write, capped at the max file size
+    long start = offset;
+    long end = min_long(start + _length, MAX_BYTES_PER_FILE);
+    if (end <= start)
+        return 0;
+    int first_block = (int)(start / BLOCK_SIZE);
+    int last_block = (int)((end - 1) / BLOCK_SIZE);
+    int count = last_block - first_block + 1;
+
+    int *blocks = malloc(sizeof(int) * count);
+    int *mapped = malloc(sizeof(int) * count);
+    map_file_blocks(file_inode, first_block, count, mapped);
+    memcpy(blocks, mapped, sizeof(int) * count);
+    int allocated = allocate_holes(file_inode, first_block, blocks, count);
+    if (allocated < 0) {
+        free(blocks);
+        free(mapped);
+        errno = ENOSPC;
         return -1;
-    if (_fd->inode < 0)
+    }
+
+    char block_buf[BLOCK_SIZE];
+    const char *buf = _buf;
+    disk_request *runs = malloc(sizeof(disk_request) * count);
+    int run_count = 0;
+    for (int i = first_block; i <= last_block;) {
+        int k = i - first_block;
+        long block_start = (long)i * BLOCK_SIZE;
+        int from = start > block_start ? (int)(start - block_start) : 0;
+        int to = (int)min_long(end - block_start, BLOCK_SIZE);
+        if (from == 0 && to == BLOCK_SIZE) {
+            // whole blocks go straight from the caller's buffer to the disk,
+            // every run of the write in one batch
+            int run = contiguous_run(blocks, k,
+                                     (int)((end - block_start) / BLOCK_SIZE));
+            runs[run_count].address = blocks[k];
+            runs[run_count].nblocks = run;
+            runs[run_count].buffer = (void *)buf;
+            run_count++;
+            buf = buf + (long)run * BLOCK_SIZE;
+            i += run;
+            continue;
+        }
+
+        // partial head and tail blocks are staged, keeping the bytes of an
+        // existing block around the write (a hole reads as 0's)
+        if (mapped[k] >= 0)
+            load_data_block(blocks[k], block_buf, BLOCK_SIZE);
+        else
+            clear_buffer(block_buf, BLOCK_SIZE);
+        memcpy(block_buf + from, buf, to - from);
+        COUNT_BYTES_COPIED(to - from);
+        sync_data_block(blocks[k], block_buf, BLOCK_SIZE);
+        buf = buf + (to - from);
+        i++;
+    }
+    int synced = sync_data_runs(runs, run_count);
+    free(runs);
+
+    // persist the allocation once for the whole write, unless the data did
+    // not reach the disk
+    if (synced < 0 ||
+        (allocated > 0 &&
+         set_file_blocks(file_inode, first_block, count, blocks) < 0)) {
+        errno = synced < 0 ? EIO : ENOSPC;
+        release_unmapped(file_inode, first_block, blocks, mapped, count);
+        free(blocks);
+        free(mapped);
         return -1;
-    _fd->inode = -1;
-    _fd->op_pointer = 0;
-    return 0;
+    }
+    free(blocks);
+    free(mapped);
+    COUNT_BYTES_SERVED(end - start);
+
+    if (end > file_inode->size)
+        file_inode->size = end;
+    mark_inode_dirty(inode_index);
+    flush_inodes();
+    return (int)(end - start);
+}
+
+/*
+ * Size of a file including the bytes waiting in its write buffer
+ */
+static long file_size(int inode_index) {
+    long size = get_inode(inode_index)->size;
+    write_buffer *buffer = get_write_buffer(inode_index);
+    if (buffer != NULL && buffer->start + buffer->length > size)
+        size = buffer->start + buffer->length;
+    return size;
+}
+
+/*
+ * Writes the write buffer of an inode (allocating all its new blocks in one
+ * batch, from its reservation) and releases it. Returns -1 if the data could
+ * not be written, the buffer then stays with its data for the next flush
+ */
+static int flush_write_buffer(int inode_index) {
+    write_buffer *buffer = get_write_buffer(inode_index);
+    if (buffer == NULL)
+        return 0;
+    begin_buffer_flush(inode_index);
+    int written = write_inode_data(inode_index, buffer->data, buffer->length,
+                                   buffer->start);
+    end_buffer_flush(inode_index, written == buffer->length);
+    if (written == buffer->length) {
+        release_write_buffer(inode_index);
+        return 0;
+    }
+    COUNT(write_buffer_errors, 1);
+    return -1;
+}
+
+static void wake_flusher(void) {
+    pthread_mutex_lock(&flusher_lock);
+    flush_wanted = true;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+/*
+ * Small writes go to the write buffer of the inode, which is flushed first
+ * when the write does not continue or overwrite it. Larger writes, and writes
+ * that find no free buffer or too few free blocks to reserve, go to the disk
+ * (which reports a full disk)
+ */
+static int buffered_write(int inode_index, const char *_buf, int _length,
+                          long offset) {
+    write_buffer *buffer = get_write_buffer(inode_index);
+    bool fits = offset + _length <= MAX_BYTES_PER_FILE;
+    if (buffer != NULL &&
+        (!fits || offset < buffer->start ||
+         offset > buffer->start + buffer->length ||
+         offset + _length > buffer->start + WRITE_BUFFER_SIZE)) {
+        if (flush_write_buffer(inode_index) < 0)
+            return -1;
+        buffer = NULL;
+    }
+
+    if (buffer == NULL) {
+        if (!fits || _length > WRITE_BUFFER_SIZE / 2)
+            return write_inode_data(inode_index, _buf, _length, offset);
+        buffer = attach_write_buffer(inode_index);
+        if (buffer == NULL) {
+            wake_flusher();
+            return write_inode_data(inode_index, _buf, _length, offset);
+        }
+        buffer->start = offset;
+    }
+
+    memcpy(buffer->data + (offset - buffer->start), _buf, _length);
+    COUNT_BYTES_COPIED(_length);
+    if (offset + _length - buffer->start > buffer->length)
+        buffer->length = offset + _length - buffer->start;
+    // a full buffer is written right away, if that fails its data is kept and
+    // the error comes with the next write, fsync or close
+    if (buffer->length == WRITE_BUFFER_SIZE)
+        flush_write_buffer(inode_index);
+    return _length;
+}
+
+/*
+ * Closes the file in the fd_table, its write buffer is flushed. The last
+ * close of a removed file gives back its inode in orphan, for delete_orphan
+ */
+int close_file(int fd, int *orphan) {
+    int status = 0;
+    bool unlinked = false;
+    int inode_index = fd_inode(fd);
+    if (inode_index < 0)
+        return -1;
+    lock_inode(inode_index, true);
+    lock_fd_table();
+    file_descriptor *_fd = get_fd(fd);
+    if (_fd == NULL || _fd->inode != inode_index) {
+        status = -1;
+    } else {
+        unlinked = _fd->unlinked;
+        _fd->inode = -1;
+        _fd->op_pointer = 0;
+        _fd->unlinked = false;
+        // the last close of a removed file frees it
+        unlinked = unlinked && !inode_open(inode_index);
+    }
+    unlock_fd_table();
+    if (unlinked) {
+        // removed while open, nothing can reach it anymore
+        release_write_buffer(inode_index);
+        *orphan = inode_index;
+    } else if (status == 0 && flush_write_buffer(inode_index) < 0) {
+        status = -1;
+    }
+    unlock_inode(inode_index);
+    return status;
 }
 
 int write_file(int _fd, const char *_buf, int _length) {
-    file_descriptor *fd = get_fd(_fd);
-    if (fd == NULL || fd->inode == -1 || _length <= 0) {
+    int inode_index = fd_inode(_fd);
+    if (inode_index == -1 || _length <= 0) {
         return -1;
     }
+    lock_inode(inode_index, true);
+    long offset = fd_pointer(_fd, -1);
+    int written = buffered_write(inode_index, _buf, _length, offset);
+    if (written > 0)
+        fd_pointer(_fd, offset + written);
+    unlock_inode(inode_index);
+    return written;
+}
 
-    inode *file_inode = get_inode(fd->inode);
-    int used_blocks[DATA_BLOCKS_CONTENT_PER_FILE];
-    clear_array(used_blocks, DATA_BLOCKS_CONTENT_PER_FILE);
-    get_inode_data_blocks(file_inode, used_blocks);
+/*
+ * Writes at the given offset, the fd pointer is left as is
+ */
+int pwrite_file(int _fd, const char *_buf, int _length, long offset) {
+    int inode_index = fd_inode(_fd);
+    if (inode_index == -1 || _length <= 0 || offset < 0) {
+        return -1;
+    }
+    lock_inode(inode_index, true);
+    int written = buffered_write(inode_index, _buf, _length, offset);
+    unlock_inode(inode_index);
+    return written;
+}
 
-    // block calc
-    int current_block_number = fd->op_pointer / BLOCK_SIZE;
-    int current_byte = fd->op_pointer % BLOCK_SIZE;
-    int length_remaining = _length;
-    int out_length = _length;
-    const char *buf = _buf;
+/*
+ * Prefetches the blocks the readahead of an fd asks for after a read of
+ * [start, end), clipped to the blocks of the file
+ */
+static void readahead(int _fd, inode *file_inode, long start, long end) {
+    int first;
+    int count = plan_readahead(_fd, start, end, &first);
+    // blocks past the size are never read
+    long file_blocks = divide_round_up(file_inode->size, BLOCK_SIZE);
+    count = (int)min_long(count, file_blocks - first);
+    if (count <= 0)
+        return;
 
-    // update size and pointer
-    int new_pointer = fd->op_pointer + _length;
-    if (new_pointer > MAX_BYTES_PER_FILE) {
-        file_inode->size = MAX_BYTES_PER_FILE;
-        out_length = file_inode->size - fd->op_pointer;
-        length_remaining = out_length;
-    } else {
-        fd->op_pointer = new_pointer;
-        file_inode->size = new_pointer;
-    }
-
-    // current block alloc
-    if (current_byte > 0) {
-        int remaining_in_current_block = BLOCK_SIZE - current_byte;
-        int amount_to_copy_first_block =
-            min(remaining_in_current_block, length_remaining);
-        char first_block_buf[BLOCK_SIZE];
-        clear_buffer(first_block_buf, BLOCK_SIZE);
-        load_data_block(used_blocks[current_block_number], first_block_buf,
-                        current_byte);
-        memcpy(first_block_buf + current_byte, buf, amount_to_copy_first_block);
-        sync_data_block(used_blocks[current_block_number++], first_block_buf,
-                        BLOCK_SIZE);
-        length_remaining = length_remaining - amount_to_copy_first_block;
-        buf = buf + amount_to_copy_first_block;
-    }
-
-    if (length_remaining <= 0)
-        return out_length;
-
-    int blocks_needed = divide_round_up(length_remaining, BLOCK_SIZE);
-    int upper_bound = current_block_number + blocks_needed;
-    int index = 0;
-    for (int i = current_block_number; i < upper_bound; ++i) {
-        if (used_blocks[i] < 0)
-            used_blocks[i] = find_one_unused_block();
-        int to_copy = min(length_remaining, BLOCK_SIZE);
-        char block_buf[to_copy];
-        memcpy(block_buf, buf + (index++ * BLOCK_SIZE), to_copy);
-        sync_data_block(used_blocks[i], block_buf, to_copy);
-        length_remaining = length_remaining - to_copy;
-    }
-
-    update_inode_data_blocks(file_inode, used_blocks);
-    return out_length;
+    int blocks[count];
+    map_file_blocks(file_inode, first, count, blocks);
+    disk_request runs[count];
+    int run_count = 0;
+    for (int i = 0; i < count;) {
+        if (blocks[i] < 0) {
+            i++;
+            continue;
+        }
+        int run = contiguous_run(blocks, i, count - i);
+        runs[run_count].address = blocks[i];
+        runs[run_count].nblocks = run;
+        runs[run_count].buffer = NULL;
+        run_count++;
+        i += run;
+    }
+    prefetch_data_runs(runs, run_count);
+}
+
+/*
+ * Reads [start, end) of a file from its data blocks (end is at most the size
+ * on the disk), holes read as 0's
+ */
+static void read_disk_data(inode *file_inode, char *_buf, long start,
+                           long end) {
+    int first_block = (int)(start / BLOCK_SIZE);
+    int last_block = (int)((end - 1) / BLOCK_SIZE);
+    int count = last_block - first_block + 1;
+    int *blocks = malloc(sizeof(int) * count);
+    map_file_blocks(file_inode, first_block, count, blocks);
+
+    char *buf = _buf;
+    disk_request *runs = malloc(sizeof(disk_request) * count);
+    int run_count = 0;
+    for (int i = first_block; i <= last_block;) {
+        int k = i - first_block;
+        long block_start = (long)i * BLOCK_SIZE;
+        int from = start > block_start ? (int)(start - block_start) : 0;
+        int to = (int)min_long(end - block_start, BLOCK_SIZE);
+        if (blocks[k] < 0) {
+            clear_buffer(buf, to - from);
+            buf = buf + (to - from);
+            i++;
+            continue;
+        }
+        if (from == 0 && to == BLOCK_SIZE) {
+            // whole blocks are read straight into the caller's buffer, every
+            // run of the read in one batch
+            int run = contiguous_run(blocks, k,
+                                     (int)((end - block_start) / BLOCK_SIZE));
+            runs[run_count].address = blocks[k];
+            runs[run_count].nblocks = run;
+            runs[run_count].buffer = buf;
+            run_count++;
+            buf = buf + (long)run * BLOCK_SIZE;
+            i += run;
+            continue;
+        }
+
+        // partial head and tail blocks are staged
+        char block_buf[BLOCK_SIZE];
+        load_data_block(blocks[k], block_buf, BLOCK_SIZE);
+        memcpy(buf, block_buf + from, to - from);
+        COUNT_BYTES_COPIED(to - from);
+        buf = buf + (to - from);
+        i++;
+    }
+    load_data_runs(runs, run_count);
+    free(runs);
+    free(blocks);
+}
+
+/*
+ * Reads from the file of an inode at the given offset through an fd (its
+ * readahead follows the read), returns the number of bytes read (0 at or past
+ * the end of the file). Bytes in the write buffer are newer than the disk,
+ * bytes past the size on the disk that are not in it are a hole (0's)
+ */
+static int read_inode_data(int _fd, int inode_index, char *_buf, int _length,
+                           long offset) {
+    inode *file_inode = get_inode(inode_index);
+    if (file_inode == NULL)
+        return -1;
+    long size = file_size(inode_index);
+    if (offset >= size || _length <= 0)
+        return 0;
+
+    long start = offset;
+    long end = offset + min_long(_length, size - offset);
+    long disk_end = min_long(end, file_inode->size);
+    if (start < disk_end)
+        read_disk_data(file_inode, _buf, start, disk_end);
+    if (disk_end < end) {
+        long hole = disk_end > start ? disk_end : start;
+        clear_buffer(_buf + (hole - start), (int)(end - hole));
+    }
+
+    write_buffer *buffer = get_write_buffer(inode_index);
+    if (buffer != NULL) {
+        long from = buffer->start > start ? buffer->start : start;
+        long to = min_long(buffer->start + buffer->length, end);
+        if (from < to) {
+            memcpy(_buf + (from - start), buffer->data + (from - buffer->start),
+                   to - from);
+            COUNT_BYTES_COPIED(to - from);
+        }
+    }
+    readahead(_fd, file_inode, start, end);
+    COUNT_BYTES_SERVED(end - start);
+    return (int)(end - start);
 }
 
+/*
+ * Reads at the fd pointer and moves it, the inode is locked exclusively so
+ * threads sharing the fd do not read the same bytes
+ */
 int read_file(int _fd, char *_buf, int _length) {
-    file_descriptor *fd = get_fd(_fd);
-    if (fd == NULL)
+    int inode_index = fd_inode(_fd);
+    if (inode_index == -1)
         return -1;
-    inode *file_inode = get_inode(fd->inode);
-    if (file_inode == NULL)
+    lock_inode(inode_index, true);
+    long offset = fd_pointer(_fd, -1);
+    int bytes_read = read_inode_data(_fd, inode_index, _buf, _length, offset);
+    if (bytes_read > 0)
+        fd_pointer(_fd, offset + bytes_read);
+    unlock_inode(inode_index);
+    return bytes_read;
+}
+
+/*
+ * Reads at the given offset, the fd pointer is left as is (readers of a file
+ * share its lock)
+ */
+int pread_file(int _fd, char *_buf, int _length, long offset) {
+    int inode_index = fd_inode(_fd);
+    if (inode_index == -1 || offset < 0)
         return -1;
-    int used_blocks[DATA_BLOCKS_CONTENT_PER_FILE];
-    clear_array(used_blocks, DATA_BLOCKS_CONTENT_PER_FILE);
-    get_inode_data_blocks(file_inode, used_blocks);
-
-    // block calc
-    int current_block_number = fd->op_pointer / BLOCK_SIZE;
-    int current_byte = fd->op_pointer % BLOCK_SIZE;
-    int length_remaining = _length;
-    int out_length = length_remaining;
-    char *buf = _buf;
+    lock_inode(inode_index, false);
+    int bytes_read = read_inode_data(_fd, inode_index, _buf, _length, offset);
+    unlock_inode(inode_index);
+    return bytes_read;
+}
 
-    int new_pointer = fd->op_pointer + out_length;
-    if (new_pointer > file_inode->size) {
-        out_length = file_inode->size - fd->op_pointer;
-        fd->op_pointer = file_inode->size;
-        length_remaining = out_length;
-    } else {
-        fd->op_pointer = new_pointer;
-    }
-
-    if (current_byte > 0) {
-        int amount_to_read = min(BLOCK_SIZE - current_byte, length_remaining);
-        char first_block_buf[BLOCK_SIZE];
-        load_data_block(used_blocks[current_block_number++], first_block_buf,
-                        BLOCK_SIZE);
-        memcpy(buf, first_block_buf + current_byte, amount_to_read);
-        buf = buf + amount_to_read;
-        length_remaining = length_remaining - amount_to_read;
-    }
-
-    if (length_remaining > 0) {
-        int blocks_to_read = divide_round_up(length_remaining, BLOCK_SIZE);
-        int upper_bound = current_block_number + blocks_to_read;
-        int index = 0;
-        for (int i = current_block_number; i < upper_bound; ++i) {
-            int to_read = min(length_remaining, BLOCK_SIZE);
-            char block_buf[to_read];
-            load_data_block(used_blocks[i], block_buf, to_read);
-            memcpy(buf + (index++ * BLOCK_SIZE), block_buf, to_read);
-            length_remaining = length_remaining - to_read;
+/*
+ * Changes the size of a file and keeps its inode (open fds stay valid).
+ * Blocks past the new size are freed, growing the file leaves a hole (0's).
+ * A shrink frees at most step file blocks from the end and returns 1 while
+ * more steps are left, the size follows the freed blocks
+ */
+static int truncate_inode(int inode_index, long size, int step) {
+    inode *file_inode = get_inode(inode_index);
+    if (flush_write_buffer(inode_index) < 0)
+        return -1;
+
+    if (size >= file_inode->size) {
+        file_inode->size = size;
+        mark_inode_dirty(inode_index);
+        flush_inodes();
+        return 0;
+    }
+
+    int blocks_kept = (int)divide_round_up(size, BLOCK_SIZE);
+    int start = free_step_start(file_inode, blocks_kept, step);
+    if (start > blocks_kept) {
+        file_inode->size = min_long(file_inode->size, (long)start * BLOCK_SIZE);
+        mark_inode_dirty(inode_index);
+        free_file_blocks(file_inode, start);
+        return 1;
+    }
+
+    // clear the end of the last block so growing the file again reads 0's
+    int tail = (int)(size % BLOCK_SIZE);
+    int last = -1;
+    if (tail > 0)
+        map_file_blocks(file_inode, blocks_kept - 1, 1, &last);
+    if (last >= 0) {
+        char block_buf[BLOCK_SIZE];
+        load_data_block(last, block_buf, BLOCK_SIZE);
+        clear_buffer(block_buf + tail, BLOCK_SIZE - tail);
+        sync_data_block(last, block_buf, BLOCK_SIZE);
+    }
+
+    file_inode->size = size;
+    mark_inode_dirty(inode_index);
+    free_file_blocks(file_inode, blocks_kept);
+    return 0;
+}
+
+static bool is_dir(int inode_index) {
+    return get_inode(inode_index)->mode == INODE_MODE_DIR;
+}
+
+/*
+ * Moves past the slashes to the next component of a path, returns its length
+ * (0 at the end of the path)
+ */
+static int next_component(const char **path) {
+    while (**path == '/')
+        (*path)++;
+    int length = 0;
+    while ((*path)[length] != '\0' && (*path)[length] != '/')
+        length++;
+    return length;
+}
+
+/*
+ * Finds the directory holding the last component of a path and copies that
+ * component into name. Returns the directory, -1 with errno set if a
+ * directory on the way is missing or the path has no component. Called with
+ * the directory lock held
+ */
+static int resolve_parent(const char *path, char *name) {
+    int dir = ROOT_INODE;
+    int length = next_component(&path);
+    if (length == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (true) {
+        if (length >= MAX_FILE_NAME_SIZE) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+        length = next_component(&path);
+        if (length == 0)
+            return dir;
+        dir = dir_lookup(dir, name);
+        if (dir < 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (!is_dir(dir)) {
+            errno = ENOTDIR;
+            return -1;
         }
     }
-    return out_length;
 }
 
 /*
- * Deletes a file and frees all data, inodes, and dir entry
+ * Returns the inode of a path and fills its directory and name, -1 with errno
+ * set if it is not there. Called with the directory lock held
+ */
+static int resolve_entry(const char *path, int *dir, char *name) {
+    *dir = resolve_parent(path, name);
+    if (*dir < 0)
+        return -1;
+    int inode_index = dir_lookup(*dir, name);
+    if (inode_index < 0)
+        errno = ENOENT;
+    return inode_index;
+}
+
+/*
+ * Returns the inode of a path ("/" is the root), -1 with errno set if it is
+ * not there. Called with the directory lock held
+ */
+static int resolve_path(const char *path) {
+    const char *rest = path;
+    if (next_component(&rest) == 0)
+        return ROOT_INODE;
+    char name[MAX_FILE_NAME_SIZE];
+    int dir;
+    return resolve_entry(path, &dir, name);
+}
+
+/*
+ * Resolves a path that must be a file
+ */
+static int resolve_file(const char *path) {
+    int inode_index = resolve_path(path);
+    if (inode_index >= 0 && is_dir(inode_index)) {
+        errno = EISDIR;
+        return -1;
+    }
+    return inode_index;
+}
+
+int truncate_file(const char *path, long size, int step) {
+    if (size < 0 || size > MAX_BYTES_PER_FILE)
+        return -1;
+    // the directory read lock keeps the file from being deleted meanwhile
+    lock_dir(false);
+    int inode_index = resolve_file(path);
+    if (inode_index < 0) {
+        unlock_dir();
+        return -1;
+    }
+    lock_inode(inode_index, true);
+    int status = truncate_inode(inode_index, size, step);
+    unlock_inode(inode_index);
+    unlock_dir();
+    return status;
+}
+
+/*
+ * Removes the dir entry of a file and marks its inode as an orphan. It is
+ * given back in orphan for delete_orphan when the file is not open, else the
+ * last close gives it back
  */
-int delete_file(char *file) {
-    directory_entry *entry = find_dir_entry(file);
-    if (entry == NULL)
+int delete_file(const char *path, int *orphan) {
+    char name[MAX_FILE_NAME_SIZE];
+    int dir;
+    lock_dir(true);
+    int inode_index = resolve_entry(path, &dir, name);
+    if (inode_index >= 0 && is_dir(inode_index)) {
+        errno = EISDIR;
+        inode_index = -1;
+    }
+    if (inode_index < 0) {
+        unlock_dir();
         return -1;
-    delete_inode(entry->inode);
-    entry->inode = 0;
-    for (int i = 0; i < MAX_FILE_NAME_SIZE; ++i) {
-        entry->name[i] = '\0';
     }
-    sync_root_dir();
+    // wait for the operations running on the file, an open file is kept
+    // until its last close
+    lock_inode(inode_index, true);
+    get_inode(inode_index)->link_cnt = INODE_LINK_ORPHAN;
+    mark_inode_dirty(inode_index);
+    flush_inodes();
+    if (!unlink_fd(inode_index)) {
+        release_write_buffer(inode_index);
+        *orphan = inode_index;
+    }
+    unlock_inode(inode_index);
+    dir_remove(dir, name);
+    unlock_dir();
     return 0;
 }
 
 /*
- * Checks to see if the file exists in the dir and returns
+ * Returns an fd for an existing file (called with the directory lock held)
+ */
+static int open_existing(int inode_index) {
+    if (is_dir(inode_index)) {
+        errno = EISDIR;
+        return -1;
+    }
+    lock_inode(inode_index, false);
+    long size = file_size(inode_index);
+    unlock_inode(inode_index);
+    return add_fd(inode_index, size);
+}
+
+/*
+ * Checks to see if the file exists in its dir and returns
  * the existing inode, otherwise creates the file
- * Creates a file and stores it in root dir
- * Increases the size in the root dir inode by 1
- * Syncs to the disk (inode and root dir)
+ * Creates a file and stores it in its dir
+ * Syncs to the disk (inode and the changed dir blocks)
  * Returns the fd of the file
  */
-int open_file(const char *name) {
-    int name_length = (int)strlen(name);
-    if (name_length >= MAX_FILE_NAME_SIZE)
-        return -1;
+int open_file(const char *path) {
+    char name[MAX_FILE_NAME_SIZE];
 
-    inode *root_inode = get_root_inode();
+    // return fd right away if file exists
+    lock_dir(false);
+    int dir = resolve_parent(path, name);
+    int existing = dir < 0 ? -1 : dir_lookup(dir, name);
+    if (dir < 0 || existing >= 0) {
+        int fd = dir < 0 ? -1 : open_existing(existing);
+        unlock_dir();
+        return fd;
+    }
+    unlock_dir();
 
-    // return fd right away if file exists in root dir
-    directory_entry *existing = find_dir_entry(name);
-    if (existing != NULL) {
-        inode *existing_inode = get_inode(existing->inode);
-        int file_size = existing_inode->size;
-        return add_fd(existing->inode, file_size);
+    // another thread may have created it while the lock was dropped
+    lock_dir(true);
+    dir = resolve_parent(path, name);
+    existing = dir < 0 ? -1 : dir_lookup(dir, name);
+    if (dir < 0 || existing >= 0) {
+        int fd = dir < 0 ? -1 : open_existing(existing);
+        unlock_dir();
+        return fd;
     }
 
-    // TODO: FIX SIZE CHECK
-    // create a new inode and increase size of root dir
     int inode_index = create_inode();
-    root_inode->size++;
+    if (inode_index < 0) {
+        errno = ENOSPC;
+        unlock_dir();
+        return -1;
+    }
 
     // add dir entry
-    int upper_bound = min(name_length, MAX_FILE_NAME_SIZE - 1);
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
-        directory_entry *entry = get_dir_entry(i);
-        if (entry->inode <= 0) {
-            entry->inode = inode_index;
-            for (int j = 0; j < upper_bound; j++) {
-                entry->name[j] = name[j];
+    if (dir_add(dir, name, inode_index) < 0) {
+        delete_inode(inode_index);
+        errno = ENOSPC;
+        unlock_dir();
+        return -1;
+    }
+    flush_inodes();
+    unlock_dir();
+    return add_fd(inode_index, 0);
+}
+
+/*
+ * Creates an empty directory, its parent must exist
+ */
+int make_dir(const char *path) {
+    char name[MAX_FILE_NAME_SIZE];
+    lock_dir(true);
+    int dir = resolve_parent(path, name);
+    if (dir < 0) {
+        unlock_dir();
+        return -1;
+    }
+    if (dir_lookup(dir, name) >= 0) {
+        errno = EEXIST;
+        unlock_dir();
+        return -1;
+    }
+    int inode_index = create_inode();
+    if (inode_index < 0) {
+        errno = ENOSPC;
+        unlock_dir();
+        return -1;
+    }
+    get_inode(inode_index)->mode = INODE_MODE_DIR;
+    mark_inode_dirty(inode_index);
+    if (dir_create(inode_index) < 0 || dir_add(dir, name, inode_index) < 0) {
+        delete_inode(inode_index);
+        errno = ENOSPC;
+        unlock_dir();
+        return -1;
+    }
+    flush_inodes();
+    unlock_dir();
+    return 0;
+}
+
+/*
+ * Removes an empty directory, its inode is given back in orphan for
+ * delete_orphan
+ */
+int remove_dir(const char *path, int *orphan) {
+    char name[MAX_FILE_NAME_SIZE];
+    int dir;
+    lock_dir(true);
+    int inode_index = resolve_entry(path, &dir, name);
+    if (inode_index >= 0 && !is_dir(inode_index)) {
+        errno = ENOTDIR;
+        inode_index = -1;
+    }
+    if (inode_index < 0) {
+        unlock_dir();
+        return -1;
+    }
+    directory_entry entry;
+    long next;
+    if (dir_read(inode_index, 0, &entry, &next, 1) > 0) {
+        errno = ENOTEMPTY;
+        unlock_dir();
+        return -1;
+    }
+    get_inode(inode_index)->link_cnt = INODE_LINK_ORPHAN;
+    mark_inode_dirty(inode_index);
+    flush_inodes();
+    dir_remove(dir, name);
+    *orphan = inode_index;
+    unlock_dir();
+    return 0;
+}
+
+/*
+ * Journal credits of the operations. A write buffer flush maps the blocks of
+ * the buffer, which may straddle a block at each end
+ */
+static int buffer_credits(void) {
+    return map_credits(WRITE_BUFFER_SIZE / BLOCK_SIZE + 2);
+}
+
+static int write_credits(int blocks) {
+    return buffer_credits() + map_credits(blocks + 1);
+}
+
+static int truncate_credits(int blocks) {
+    return buffer_credits() + free_credits(blocks, false);
+}
+
+static int file_free_credits(int blocks) { return free_credits(blocks, false); }
+
+static int dir_free_credits(int blocks) { return free_credits(blocks, true); }
+
+// the new inode and the directory entry
+static int create_credits(void) { return 1 + dir_add_credits(); }
+
+// the inode marked as an orphan and the leaf of the entry
+static int remove_credits(void) { return 2; }
+
+/*
+ * The most file blocks (a power of 2) a step maps or frees with its credits
+ * in at most half of a transaction
+ */
+static int step_blocks(int (*credits)(int)) {
+    int blocks = 1;
+    while (blocks < MAX_BLOCKS_PER_FILE &&
+           credits(blocks * 2) <= JOURNAL_DESCRIPTOR_ENTRIES / 2)
+        blocks *= 2;
+    return blocks;
+}
+
+/*
+ * Frees the blocks of an orphan from the end of the file, then its inode,
+ * each step in its own operation. Nothing else can reach the inode, a crash
+ * halfway leaves the orphan to the next mount
+ */
+static void delete_orphan(int inode_index) {
+    bool dir = is_dir(inode_index);
+    int step = step_blocks(dir ? dir_free_credits : file_free_credits);
+    int start;
+    do {
+        // a journal that fails leaves the orphan to the next mount
+        if (journal_begin_op(free_credits(step, dir)) < 0)
+            return;
+        lock_inode(inode_index, true);
+        inode *node = get_inode(inode_index);
+        start = free_step_start(node, 0, step);
+        if (start > 0)
+            free_file_blocks(node, start);
+        else
+            delete_inode(inode_index);
+        unlock_inode(inode_index);
+        journal_end_op();
+    } while (start > 0);
+}
+
+/*
+ * Frees the orphans left by a crash, at mount
+ */
+static void delete_orphans(void) {
+    for (int i = 0; i < INODE_COUNT; i++) {
+        inode *node = get_inode(i);
+        if (node->mode != INODE_MODE_UNUSED &&
+            node->link_cnt == INODE_LINK_ORPHAN)
+            delete_orphan(i);
+    }
+}
+
+/*
+ * Writes at the fd pointer (offset < 0) or at the offset, in steps that each
+ * are an operation. A step that finds the disk full (ENOSPC, nothing of it
+ * written) is tried again once after a commit when blocks freed before it
+ * wait for theirs, an operation cannot commit its own frees. Any other
+ * failure, or a failed commit, is returned as is
+ */
+static int write_steps(int _fd, const char *buf, int length, long offset) {
+    int blocks = step_blocks(write_credits);
+    int written = 0;
+    bool retried = false;
+    do {
+        int chunk = (int)min_long(length - written, (long)blocks * BLOCK_SIZE);
+        if (journal_begin_op(write_credits(blocks)) < 0)
+            return written > 0 ? written : -1;
+        // the blocks the step itself frees on failure do not count
+        int pending = pending_blocks();
+        int done = offset < 0 ? write_file(_fd, buf + written, chunk)
+                              : pwrite_file(_fd, buf + written, chunk,
+                                            offset + written);
+        journal_end_op();
+        if (done < 0 && errno == ENOSPC && pending > 0 && !retried) {
+            retried = true;
+            if (disk_sync() < 0) {
+                errno = EIO;
+                return written > 0 ? written : -1;
             }
-            entry->name[upper_bound] = '\0';
+            continue;
+        }
+        if (done <= 0)
+            return written > 0 ? written : done;
+        written += done;
+        if (done < chunk)
+            break;
+    } while (written < length);
+    return written;
+}
+
+/*
+ * Flushes every write buffer, each one in its own operation
+ */
+static int flush_write_buffers(void) {
+    pthread_mutex_lock(&flush_list_lock);
+    int count = buffered_inodes(flush_list);
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        if (journal_begin_op(buffer_credits()) < 0) {
+            status = -1;
             break;
         }
+        lock_inode(flush_list[i], true);
+        if (flush_write_buffer(flush_list[i]) < 0)
+            status = -1;
+        unlock_inode(flush_list[i]);
+        journal_end_op();
     }
-    sync_root_dir();
-    sync_inodes(inode_tb);
-    return add_fd(inode_index, 0);
+    pthread_mutex_unlock(&flush_list_lock);
+    return status;
+}
+
+static void *flusher(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        if (!flush_wanted) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += flush_ms / 1000;
+            deadline.tv_nsec += (long)(flush_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+        }
+        if (flusher_stop)
+            break;
+        flush_wanted = false;
+        pthread_mutex_unlock(&flusher_lock);
+        flush_write_buffers();
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+static worker_fork_state flusher_fork = {{&flush_list_lock, &flusher_lock},
+                                         {&flusher_cond, NULL},
+                                         &flusher_running};
+
+static void start_flusher(void) {
+    register_worker_fork(&flusher_fork);
+    if (flusher_running)
+        return;
+    flush_ms = WRITE_BUFFER_MS;
+    const char *env = getenv(WRITE_BUFFER_ENV);
+    if (env != NULL && atoi(env) > 0)
+        flush_ms = atoi(env);
+    flusher_stop = false;
+    flush_wanted = false;
+    if (pthread_create(&flusher_thread, NULL, flusher, NULL) == 0)
+        flusher_running = true;
+}
+
+static void stop_flusher(void) {
+    if (!flusher_running)
+        return;
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = true;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher_thread, NULL);
+    flusher_running = false;
 }
 
 /*
@@ -209,65 +1047,227 @@ int open_file(const char *name) {
 
 void mksfs(int fresh) {
     current_file_name_index = 0;
+    stop_flusher();
+    stop_reclaim();
+    if (flush_list == NULL)
+        flush_list = malloc(sizeof(int) * WRITE_BUFFER_COUNT);
     if (fresh) {
         disk_init(fresh);
         init_super_block();
         init_fbm(fresh);
         init_inode_table();
-        init_root_dir_cache();
+        init_dentry_cache();
         create_root_directory();
         init_fd_table();
+        init_write_buffers();
     } else {
         disk_init(fresh);
+        // the format version before init_inode_table moves it forward
+        super_block block;
+        load_super_block(&block);
         init_fbm(fresh);
         init_inode_table();
-        init_root_dir_cache();
-        load_root_dir();
+        init_dentry_cache();
+        load_root_dir(block.version);
+        delete_orphans();
         init_fd_table();
+        init_write_buffers();
     }
+    // the format (or a migration) is committed before the first operation
+    if (disk_sync() < 0)
+        printf("Could not commit the file system to the disk\n");
+    sfs_start();
+}
+
+void sfs_start(void) {
+    start_reclaim();
+    journal_start();
+    start_flusher();
 }
 
 int sfs_getnextfilename(char *name) {
-    int index = current_file_name_index;
-    directory_entry *entry = get_dir_entry(index);
-    while (true) {
-        if (entry != NULL && entry->inode > 0)
-            break;
-        if (index >= MAX_NUMBER_OF_DIRECTORY_ENTRIES) {
-            current_file_name_index = 0;
-            return 0;
-        }
-        entry = get_dir_entry(++index);
+    // the cursor moves, take the lock exclusively
+    lock_dir(true);
+    directory_entry entry;
+    int found = dir_read(ROOT_INODE, current_file_name_index, &entry,
+                         &current_file_name_index, 1);
+    if (found)
+        strcpy(name, entry.name);
+    else
+        current_file_name_index = 0;
+    unlock_dir();
+    return found;
+}
+
+long sfs_getfilesize(const char *path) {
+    lock_dir(false);
+    int inode_index = resolve_file(path);
+    long size = -1;
+    if (inode_index >= 0) {
+        lock_inode(inode_index, false);
+        size = file_size(inode_index);
+        unlock_inode(inode_index);
     }
-    current_file_name_index = index + 1;
-    strcpy(name, entry->name);
-    return 1;
+    unlock_dir();
+    return size;
 }
 
-int sfs_getfilesize(const char *path) {
-    directory_entry *file = find_dir_entry(path);
-    if (file == NULL)
-        return -1;
-    inode *file_inode = get_inode(file->inode);
-    return file_inode->size;
+/*
+ * Fills the attributes of an inode, called with the directory lock held
+ */
+static void get_attr(int inode_index, sfs_attr *attr) {
+    attr->inode = inode_index;
+    attr->directory = is_dir(inode_index);
+    lock_inode(inode_index, false);
+    attr->size = file_size(inode_index);
+    unlock_inode(inode_index);
 }
 
-int sfs_fopen(char *name) { return open_file(name); }
+int sfs_stat(const char *path, sfs_attr *attr) {
+    lock_dir(false);
+    int inode_index = resolve_path(path);
+    if (inode_index >= 0)
+        get_attr(inode_index, attr);
+    unlock_dir();
+    return inode_index < 0 ? -1 : 0;
+}
 
-int sfs_fclose(int fileId) { return close_file(fileId); }
+int sfs_readdir(const char *path, long cookie, sfs_dirent *entries, int max) {
+    if (cookie < 0 || max < 1)
+        return 0;
+    directory_entry *found = malloc(sizeof(directory_entry) * max);
+    long *next = malloc(sizeof(long) * max);
+    lock_dir(false);
+    int dir = resolve_path(path);
+    int count = -1;
+    if (dir >= 0 && !is_dir(dir))
+        errno = ENOTDIR;
+    else if (dir >= 0)
+        count = dir_read(dir, cookie, found, next, max);
+    for (int i = 0; i < count; i++) {
+        memcpy(entries[i].name, found[i].name, MAX_FILE_NAME_SIZE);
+        entries[i].cookie = next[i];
+        get_attr(found[i].inode, &entries[i].attr);
+    }
+    unlock_dir();
+    free(found);
+    free(next);
+    return count;
+}
+
+/*
+ * Every operation that changes the disk is bracketed for the journal with the
+ * credits it needs, a transaction only commits between operations. Reads log
+ * nothing and are not bracketed. A large write, truncate or delete goes in
+ * steps, each one a complete operation
+ */
+int sfs_fopen(const char *path) {
+    if (journal_begin_op(create_credits()) < 0)
+        return -1;
+    int fd = open_file(path);
+    journal_end_op();
+    return fd;
+}
+
+int sfs_fclose(int fileId) {
+    int orphan = -1;
+    if (journal_begin_op(buffer_credits()) < 0)
+        return -1;
+    int status = close_file(fileId, &orphan);
+    journal_end_op();
+    if (orphan >= 0)
+        delete_orphan(orphan);
+    return status;
+}
 
 int sfs_fwrite(int fileId, const char *buf, int length) {
-    return write_file(fileId, buf, length);
+    return write_steps(fileId, buf, length, -1);
 }
 
 int sfs_fread(int fileId, char *buf, int length) {
     return read_file(fileId, buf, length);
 }
 
-int sfs_fseek(int fileId, int loc) {
+int sfs_pwrite(int fileId, const char *buf, int length, long offset) {
+    if (offset < 0)
+        return -1;
+    return write_steps(fileId, buf, length, offset);
+}
+
+int sfs_pread(int fileId, char *buf, int length, long offset) {
+    return pread_file(fileId, buf, length, offset);
+}
+
+int sfs_fseek(int fileId, long loc) {
+    if (loc < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    lock_fd_table();
     file_descriptor *fd = get_fd(fileId);
-    fd->op_pointer = loc;
-    return 0;
+    if (fd != NULL)
+        fd->op_pointer = loc;
+    unlock_fd_table();
+    return fd == NULL ? -1 : 0;
+}
+
+int sfs_remove(const char *path) {
+    int orphan = -1;
+    if (journal_begin_op(remove_credits()) < 0)
+        return -1;
+    int status = delete_file(path, &orphan);
+    journal_end_op();
+    if (orphan >= 0)
+        delete_orphan(orphan);
+    return status;
+}
+
+int sfs_truncate(const char *path, long size) {
+    int step = step_blocks(truncate_credits);
+    int status;
+    do {
+        if (journal_begin_op(truncate_credits(step)) < 0)
+            return -1;
+        status = truncate_file(path, size, step);
+        journal_end_op();
+    } while (status > 0);
+    return status;
 }
 
-int sfs_remove(char *file) { return delete_file(file); }
+int sfs_mkdir(const char *path) {
+    if (journal_begin_op(create_credits() + map_credits(2) + 2) < 0)
+        return -1;
+    int status = make_dir(path);
+    journal_end_op();
+    return status;
+}
+
+int sfs_rmdir(const char *path) {
+    int orphan = -1;
+    if (journal_begin_op(remove_credits()) < 0)
+        return -1;
+    int status = remove_dir(path, &orphan);
+    journal_end_op();
+    if (orphan >= 0)
+        delete_orphan(orphan);
+    return status;
+}
+
+int sfs_sync(void) {
+    int status = flush_write_buffers();
+    flush_fbm();
+    if (disk_sync() < 0)
+        status = -1;
+    if (status < 0)
+        errno = EIO;
+    return status;
+}
+
+void sfs_unmount(void) {
+    // the buffers may need the reclaim worker to find free blocks
+    stop_flusher();
+    flush_write_buffers();
+    stop_reclaim();
+    flush_fbm();
+    disk_close();
+}
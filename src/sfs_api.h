@@ -3,14 +3,43 @@
 
 #include "sfs_cache.h"
 
+/*
+ * What sfs_stat reports about a path
+ */
+typedef struct {
+    int inode;
+    bool directory;
+    long size;
+} sfs_attr;
+
+/*
+ * A directory entry listed by sfs_readdir, the cookie is where the listing
+ * goes on after it
+ */
+typedef struct {
+    char name[MAX_FILE_NAME_SIZE];
+    long cookie;
+    sfs_attr attr;
+} sfs_dirent;
+
 void mksfs(int);
+void sfs_start(void);
 int sfs_getnextfilename(char *);
-int sfs_getfilesize(const char *);
-int sfs_fopen(char *);
+long sfs_getfilesize(const char *);
+int sfs_fopen(const char *);
 int sfs_fclose(int);
 int sfs_fwrite(int, const char *, int);
 int sfs_fread(int, char *, int);
-int sfs_fseek(int, int);
-int sfs_remove(char *);
+int sfs_pwrite(int, const char *, int, long);
+int sfs_pread(int, char *, int, long);
+int sfs_fseek(int, long);
+int sfs_remove(const char *);
+int sfs_truncate(const char *, long);
+int sfs_stat(const char *, sfs_attr *);
+int sfs_readdir(const char *, long, sfs_dirent *, int);
+int sfs_mkdir(const char *);
+int sfs_rmdir(const char *);
+int sfs_sync(void);
+void sfs_unmount(void);
 
 #endif
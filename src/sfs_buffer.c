@@ -0,0 +1,457 @@
+#include "sfs_buffer.h"
+#include "disk_emu.h"
+#include "sfs_disk.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * One cached disk block
+ */
+typedef struct {
+    int address;
+    bool valid;
+    bool dirty;
+    bool referenced;
+    bool prefetched;
+    int next;
+} buffer_slot;
+
+static buffer_slot *slots;
+
+static char *slot_data;
+
+static int slot_count;
+
+static int *buckets;
+
+static int bucket_mask;
+
+static int clock_hand;
+
+static buffer_cache_stats stats;
+
+/*
+ * Guards the slots, the hash and the counters. Misses are read from the disk
+ * without it so other threads keep using the cache meanwhile
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *slot_buf(int slot) {
+    return slot_data + (size_t)slot * BLOCK_SIZE;
+}
+
+static int bucket_of(int address) {
+    return (int)(((unsigned)address * 2654435761u) & (unsigned)bucket_mask);
+}
+
+static int lookup_slot(int address) {
+    for (int s = buckets[bucket_of(address)]; s >= 0; s = slots[s].next) {
+        if (slots[s].address == address)
+            return s;
+    }
+    return -1;
+}
+
+static void unlink_slot(int slot) {
+    int *link = &buckets[bucket_of(slots[slot].address)];
+    while (*link != slot)
+        link = &slots[*link].next;
+    *link = slots[slot].next;
+    slots[slot].valid = false;
+    if (slots[slot].prefetched)
+        stats.readahead_wasted++;
+}
+
+/*
+ * A read served from the cache, the first one of a prefetched block makes the
+ * readahead a hit
+ */
+static void touch_slot(int slot) {
+    slots[slot].referenced = true;
+    if (slots[slot].prefetched) {
+        slots[slot].prefetched = false;
+        stats.readahead_hits++;
+    }
+}
+
+/*
+ * A slot is only clean once its block is on the disk, a failed write keeps it
+ * dirty
+ */
+static int write_back(int slot) {
+    if (write_blocks(slots[slot].address, SINGLE_BLOCK, slot_buf(slot)) < 0)
+        return -1;
+    slots[slot].dirty = false;
+    stats.writebacks++;
+    return 0;
+}
+
+/*
+ * CLOCK eviction: skip recently referenced slots (clearing their bit), take
+ * the first free or unreferenced one and write it back if it is dirty. A
+ * slot whose write back fails stays in the cache, -1 when two turns of the
+ * clock found no slot
+ */
+static int evict_slot(void) {
+    for (int step = 0; step < 2 * slot_count; step++) {
+        int slot = clock_hand;
+        clock_hand = (clock_hand + 1) % slot_count;
+        if (!slots[slot].valid)
+            return slot;
+        if (slots[slot].referenced) {
+            slots[slot].referenced = false;
+            continue;
+        }
+        if (slots[slot].dirty && write_back(slot) < 0)
+            continue;
+        unlink_slot(slot);
+        stats.evictions++;
+        return slot;
+    }
+    return -1;
+}
+
+static int insert_slot(int address) {
+    int slot = evict_slot();
+    if (slot < 0)
+        return -1;
+    int bucket = bucket_of(address);
+    slots[slot].address = address;
+    slots[slot].valid = true;
+    slots[slot].dirty = false;
+    slots[slot].referenced = true;
+    slots[slot].prefetched = false;
+    slots[slot].next = buckets[bucket];
+    buckets[bucket] = slot;
+    return slot;
+}
+
+void buffer_cache_init(int capacity) {
+    buffer_cache_close();
+    if (capacity <= 0)
+        return;
+
+    int bucket_count = 1;
+    while (bucket_count < capacity)
+        bucket_count <<= 1;
+
+    slots = malloc(sizeof(buffer_slot) * capacity);
+    slot_data = malloc((size_t)capacity * BLOCK_SIZE);
+    buckets = malloc(sizeof(int) * bucket_count);
+    slot_count = capacity;
+    bucket_mask = bucket_count - 1;
+    clock_hand = 0;
+    for (int i = 0; i < capacity; i++) {
+        slots[i].valid = false;
+        slots[i].dirty = false;
+        slots[i].referenced = false;
+        slots[i].prefetched = false;
+        slots[i].next = -1;
+    }
+    for (int i = 0; i < bucket_count; i++) {
+        buckets[i] = -1;
+    }
+    register_disk_buffer(slot_data, (size_t)capacity * BLOCK_SIZE);
+}
+
+void buffer_cache_close(void) {
+    if (slots == NULL)
+        return;
+    buffer_flush();
+    unregister_disk_buffer();
+    free(slots);
+    free(slot_data);
+    free(buckets);
+    slots = NULL;
+    slot_data = NULL;
+    buckets = NULL;
+    slot_count = 0;
+}
+
+/*
+ * Copies blocks read from the disk into the cache (called with the lock held
+ * after a miss was read without it). A block another thread cached meanwhile
+ * is at least as new as the disk, the caller gets that copy instead
+ */
+static void fill_slots(int address, int nblocks, char *out, bool insert) {
+    for (int j = 0; j < nblocks; j++) {
+        char *block = out + (size_t)j * BLOCK_SIZE;
+        int slot = lookup_slot(address + j);
+        if (slot >= 0) {
+            memcpy(block, slot_buf(slot), BLOCK_SIZE);
+        } else if (insert && (slot = insert_slot(address + j)) >= 0) {
+            memcpy(slot_buf(slot), block, BLOCK_SIZE);
+        }
+    }
+}
+
+int buffer_read_blocks(int address, int nblocks, void *buf) {
+    if (slots == NULL)
+        return read_blocks(address, nblocks, buf);
+
+    char *out = buf;
+    int i = 0;
+    pthread_mutex_lock(&cache_lock);
+    while (i < nblocks) {
+        int slot = lookup_slot(address + i);
+        if (slot >= 0) {
+            touch_slot(slot);
+            memcpy(out + (size_t)i * BLOCK_SIZE, slot_buf(slot), BLOCK_SIZE);
+            COUNT_BYTES_COPIED(BLOCK_SIZE);
+            stats.hits++;
+            i++;
+            continue;
+        }
+
+        // read the whole run of missing blocks at once
+        int run = 1;
+        while (i + run < nblocks && lookup_slot(address + i + run) < 0)
+            run++;
+        pthread_mutex_unlock(&cache_lock);
+        int status =
+            read_blocks(address + i, run, out + (size_t)i * BLOCK_SIZE);
+        pthread_mutex_lock(&cache_lock);
+        if (status < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        fill_slots(address + i, run, out + (size_t)i * BLOCK_SIZE, true);
+        COUNT_BYTES_COPIED((long)run * BLOCK_SIZE);
+        stats.misses += run;
+        i += run;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
+
+int buffer_write_blocks(int address, int nblocks, const void *buf) {
+    if (slots == NULL)
+        return write_blocks(address, nblocks, (void *)buf);
+
+    const char *in = buf;
+    int status = nblocks;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nblocks; i++) {
+        int slot = lookup_slot(address + i);
+        if (slot < 0)
+            slot = insert_slot(address + i);
+        if (slot < 0) {
+            // every slot is dirty and pinned, write through
+            if (write_blocks(address + i, SINGLE_BLOCK,
+                             (char *)in + (size_t)i * BLOCK_SIZE) < 0)
+                status = -1;
+            continue;
+        }
+        if (slots[slot].prefetched) {
+            // overwritten before anyone read it
+            slots[slot].prefetched = false;
+            stats.readahead_wasted++;
+        }
+        slots[slot].referenced = true;
+        slots[slot].dirty = true;
+        memcpy(slot_buf(slot), in + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    COUNT_BYTES_COPIED((long)nblocks * BLOCK_SIZE);
+    return status;
+}
+
+int buffer_read_runs(disk_request *runs, int count) {
+    if (slots == NULL)
+        return read_blocks_batch(runs, count);
+
+    int total = 0;
+    for (int r = 0; r < count; r++) {
+        total += runs[r].nblocks;
+    }
+    // cached blocks are copied, the missing ones are read in one batch
+    disk_request *misses = malloc(sizeof(disk_request) * (total + 1));
+    int miss_count = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int r = 0; r < count; r++) {
+        char *out = runs[r].buffer;
+        int address = runs[r].address;
+        int i = 0;
+        while (i < runs[r].nblocks) {
+            int slot = lookup_slot(address + i);
+            if (slot >= 0) {
+                // the cached copy may be newer than the disk
+                touch_slot(slot);
+                memcpy(out + (size_t)i * BLOCK_SIZE, slot_buf(slot),
+                       BLOCK_SIZE);
+                COUNT_BYTES_COPIED(BLOCK_SIZE);
+                stats.hits++;
+                i++;
+                continue;
+            }
+
+            int run = 1;
+            while (i + run < runs[r].nblocks &&
+                   lookup_slot(address + i + run) < 0)
+                run++;
+            misses[miss_count].address = address + i;
+            misses[miss_count].nblocks = run;
+            misses[miss_count].buffer = out + (size_t)i * BLOCK_SIZE;
+            miss_count++;
+            i += run;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    int status = read_blocks_batch(misses, miss_count);
+    if (status >= 0) {
+        pthread_mutex_lock(&cache_lock);
+        for (int m = 0; m < miss_count; m++) {
+            fill_slots(misses[m].address, misses[m].nblocks,
+                       misses[m].buffer, false);
+            stats.bypassed += misses[m].nblocks;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        status = count;
+    }
+    free(misses);
+    return status;
+}
+
+int buffer_write_runs(disk_request *runs, int count) {
+    if (slots != NULL) {
+        pthread_mutex_lock(&cache_lock);
+        for (int r = 0; r < count; r++) {
+            for (int i = 0; i < runs[r].nblocks; i++) {
+                int slot = lookup_slot(runs[r].address + i);
+                if (slot >= 0)
+                    unlink_slot(slot);
+            }
+            stats.bypassed += runs[r].nblocks;
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return write_blocks_batch(runs, count);
+}
+
+void buffer_prefetch_runs(disk_request *runs, int count) {
+    if (slots == NULL)
+        return;
+
+    int total = 0;
+    for (int r = 0; r < count; r++) {
+        total += runs[r].nblocks;
+    }
+    // only the blocks that are not cached yet are read, into one staging
+    // buffer
+    disk_request *misses = malloc(sizeof(disk_request) * (total + 1));
+    char *staging = malloc((size_t)(total + 1) * BLOCK_SIZE);
+    int miss_count = 0;
+    int staged = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int r = 0; r < count; r++) {
+        int address = runs[r].address;
+        int i = 0;
+        while (i < runs[r].nblocks) {
+            if (lookup_slot(address + i) >= 0) {
+                i++;
+                continue;
+            }
+            int run = 1;
+            while (i + run < runs[r].nblocks &&
+                   lookup_slot(address + i + run) < 0)
+                run++;
+            misses[miss_count].address = address + i;
+            misses[miss_count].nblocks = run;
+            misses[miss_count].buffer = staging + (size_t)staged * BLOCK_SIZE;
+            miss_count++;
+            staged += run;
+            i += run;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (miss_count > 0 && read_blocks_batch(misses, miss_count) >= 0) {
+        pthread_mutex_lock(&cache_lock);
+        for (int m = 0; m < miss_count; m++) {
+            for (int j = 0; j < misses[m].nblocks; j++) {
+                // a block cached meanwhile is at least as new as the disk
+                if (lookup_slot(misses[m].address + j) >= 0)
+                    continue;
+                int slot = insert_slot(misses[m].address + j);
+                if (slot < 0)
+                    break;
+                memcpy(slot_buf(slot),
+                       (char *)misses[m].buffer + (size_t)j * BLOCK_SIZE,
+                       BLOCK_SIZE);
+                // it is only referenced once the reader gets to it
+                slots[slot].referenced = false;
+                slots[slot].prefetched = true;
+                stats.readahead++;
+            }
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    free(staging);
+    free(misses);
+}
+
+void buffer_discard(int address, int nblocks) {
+    if (slots == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nblocks; i++) {
+        int slot = lookup_slot(address + i);
+        if (slot >= 0)
+            unlink_slot(slot);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int compare_slot_address(const void *a, const void *b) {
+    int sa = *(const int *)a;
+    int sb = *(const int *)b;
+    return slots[sa].address - slots[sb].address;
+}
+
+int buffer_flush(void) {
+    if (slots == NULL)
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    int *dirty = malloc(sizeof(int) * slot_count);
+    int dirty_count = 0;
+    for (int i = 0; i < slot_count; i++) {
+        if (slots[i].valid && slots[i].dirty)
+            dirty[dirty_count++] = i;
+    }
+    qsort(dirty, dirty_count, sizeof(int), compare_slot_address);
+
+    // one batch for every dirty block, consecutive addresses are merged
+    // into a single vectored write where the disk has no queue. The blocks
+    // stay dirty if it fails
+    disk_request *requests = malloc(sizeof(disk_request) * (dirty_count + 1));
+    for (int i = 0; i < dirty_count; i++) {
+        requests[i].address = slots[dirty[i]].address;
+        requests[i].nblocks = SINGLE_BLOCK;
+        requests[i].buffer = slot_buf(dirty[i]);
+    }
+    int status = write_blocks_batch(requests, dirty_count) < 0 ? -1 : 0;
+    for (int i = 0; status == 0 && i < dirty_count; i++) {
+        slots[dirty[i]].dirty = false;
+    }
+    if (status == 0)
+        stats.writebacks += dirty_count;
+    free(requests);
+    free(dirty);
+    pthread_mutex_unlock(&cache_lock);
+    return status;
+}
+
+void buffer_cache_get_stats(buffer_cache_stats *out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void buffer_cache_reset_stats(void) {
+    pthread_mutex_lock(&cache_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&cache_lock);
+}
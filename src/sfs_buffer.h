@@ -0,0 +1,80 @@
+#ifndef SFS_BUFFER_H
+#define SFS_BUFFER_H
+
+#include "disk_emu.h"
+
+/*
+ * Buffer cache counters
+ */
+typedef struct {
+    long hits;
+    long misses;
+    long writebacks;
+    long evictions;
+    long bypassed;
+    long readahead;
+    long readahead_hits;
+    long readahead_wasted;
+} buffer_cache_stats;
+
+/*
+ * Sets up the block cache with room for the given number of blocks (0 turns
+ * the cache off and every call goes straight to the disk)
+ */
+void buffer_cache_init(int);
+
+/*
+ * Flushes every dirty block and releases the cache
+ */
+void buffer_cache_close(void);
+
+/*
+ * Reads consecutive blocks through the cache
+ */
+int buffer_read_blocks(int, int, void *);
+
+/*
+ * Writes consecutive blocks into the cache, they are written to the disk when
+ * evicted or flushed
+ */
+int buffer_write_blocks(int, int, const void *);
+
+/*
+ * Reads a batch of block runs without filling the cache, blocks that are
+ * cached are copied from it and the rest is read straight into the buffers
+ * (all runs at once)
+ */
+int buffer_read_runs(disk_request *, int);
+
+/*
+ * Writes a batch of block runs straight to the disk and drops their cached
+ * copies
+ */
+int buffer_write_runs(disk_request *, int);
+
+/*
+ * Reads a batch of block runs into the cache ahead of the reader (runs carry
+ * no buffer). Blocks that are read before they are evicted count as
+ * readahead hits, the others as waste
+ */
+void buffer_prefetch_runs(disk_request *, int);
+
+/*
+ * Drops the cached copies of consecutive blocks without writing them back
+ */
+void buffer_discard(int, int);
+
+/*
+ * Writes every dirty block to the disk
+ */
+int buffer_flush(void);
+
+/*
+ * Copies the hit, miss, writeback and readahead counters into the given
+ * struct
+ */
+void buffer_cache_get_stats(buffer_cache_stats *);
+
+void buffer_cache_reset_stats(void);
+
+#endif
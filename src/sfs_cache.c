@@ -1,28 +1,163 @@
 #include "sfs_cache.h"
+#include "sfs_journal.h"
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 inode_table *inode_tb;
 
-free_byte_map *free_bm;
-
-directory *root_directory;
+free_bitmap *free_bm;
 
 file_descriptor_table *fd_table;
 
+/*
+ * inode table blocks that changed since the last flush
+ */
+static bool *inode_block_dirty;
+
+/*
+ * The inode table as flush_inodes writes it. Inodes change in inode_tb under
+ * their own lock and are copied here when they are marked dirty, so a flush
+ * never reads an inode that is being changed (inode table lock)
+ */
+static inode_table table_image;
+
+/*
+ * Unused inodes, a queue (ring of INODE_COUNT entries) in index order at
+ * mount: create_inode takes the head and delete_inode appends, so a freed
+ * inode is the last one reused (guarded by the inode table lock)
+ */
+static int *free_inodes;
+
+static int free_inode_head;
+
+static int free_inode_count;
+
+/*
+ * Locks. Order: directory, inode, then the inner mutexes (inode table,
+ * allocator, fd table) which are never held together
+ */
+static pthread_rwlock_t *inode_locks;
+
+/*
+ * A run of file blocks mapped to consecutive data blocks
+ */
+typedef struct {
+    int file_block;
+    int block;
+    int length;
+} block_extent;
+
+/*
+ * Resolved block map of an inode, its mapped blocks as extents sorted by file
+ * block. Built the first time the file is mapped and kept up to date by
+ * set_file_blocks and free_file_blocks, so mapping needs no index block
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    bool loaded;
+    block_extent *extents;
+    int count;
+    int capacity;
+} extent_map;
+
+static extent_map *extent_maps;
+
+static int inode_lock_count;
+
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Write buffer pool. The buffer of an inode is attached and released with the
+ * inode lock and write_buffer_lock held, so either one is enough to look at it
+ */
+static write_buffer *write_buffer_pool;
+
+static char *write_buffer_data;
+
+static write_buffer **write_buffers;
+
+static bool write_buffer_used[WRITE_BUFFER_COUNT];
+
+static pthread_mutex_t write_buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * free blocks per fbm region, word where the next allocation search starts
+ * and fbm blocks that changed since the last flush
+ */
+static int *region_free;
+
+static int alloc_hint;
+
+static bool *fbm_block_dirty;
+
+/*
+ * Reclaim map, freed blocks stay used in the fbm until the reclaim worker has
+ * scrubbed them. The worker only takes blocks whose free is committed in the
+ * journal (ready), until then a crash brings their file back. A batch it
+ * scrubs is taken out of the ready blocks (busy), an allocation that finds
+ * the disk full takes the other ready blocks itself. The allocator lock
+ * guards the maps, the worker takes it while it picks and releases blocks
+ */
+#define SCRUB_NONE 0
+#define SCRUB_PUNCH 1
+#define SCRUB_ZERO 2
+#define RECLAIM_BATCH 64
+// bitmap blocks a batch spans at most, it releases them in one operation
+#define RECLAIM_BATCH_MAP_BLOCKS 4
+
+static free_bitmap *reclaim_bm;
+
+static free_bitmap *reclaim_ready;
+
+static int reclaim_ready_count;
+
+static extent reclaim_busy[RECLAIM_BATCH];
+
+static int reclaim_busy_count;
+
+static bool *reclaim_block_dirty;
+
+static int reclaim_pending;
+
+static int scrub_mode;
+
+static bool reclaim_running;
+
+static bool reclaim_stop;
+
+static pthread_t reclaim_thread;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Delayed allocation: a write buffer reserves the free blocks its flush may
+ * take when it is attached, so a full disk fails the write instead of the
+ * flush. Allocations leave the reserved blocks alone, except a flush, which
+ * takes its own reservation (own) first. Guarded by the allocator lock
+ */
+static int free_block_count;
+
+static int reserved_blocks;
+
+static __thread int own_reserved;
+
 void clear_array(int *arr, int count) {
     for (int i = 0; i < count; ++i) {
         arr[i] = -1;
     }
 }
 
-directory_entry *get_dir_entry(int entry) {
-    if (entry < 0 || entry >= MAX_NUMBER_OF_DIRECTORY_ENTRIES)
-        return NULL;
-    return &root_directory->entries[entry];
-}
-
 file_descriptor *get_fd(int fd) {
     if (fd < 0 || fd >= MAX_NUMBER_OF_DIRECTORY_ENTRIES)
         return NULL;
@@ -37,261 +172,1376 @@ inode *get_inode(int index) {
 
 inode *get_root_inode(void) { return get_inode(ROOT_INODE); }
 
-void clear_root_dir(void) {
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
-        root_directory->entries[i].inode = 0;
-        for (int j = 0; j < MAX_FILE_NAME_SIZE; j++) {
-            root_directory->entries[i].name[j] = '\0';
+int get_inode_index(inode *node) { return (int)(node - inode_tb->inodes); }
+
+void lock_inode(int index, bool write) {
+    if (write)
+        pthread_rwlock_wrlock(&inode_locks[index]);
+    else
+        pthread_rwlock_rdlock(&inode_locks[index]);
+}
+
+void unlock_inode(int index) { pthread_rwlock_unlock(&inode_locks[index]); }
+
+void lock_dir(bool write) {
+    if (write)
+        pthread_rwlock_wrlock(&dir_lock);
+    else
+        pthread_rwlock_rdlock(&dir_lock);
+}
+
+void unlock_dir(void) { pthread_rwlock_unlock(&dir_lock); }
+
+void lock_fd_table(void) { pthread_mutex_lock(&fd_lock); }
+
+void unlock_fd_table(void) { pthread_mutex_unlock(&fd_lock); }
+
+void mark_inode_dirty(int index) {
+    if (index < 0 || index >= INODE_COUNT)
+        return;
+    pthread_mutex_lock(&inode_table_lock);
+    table_image.inodes[index] = inode_tb->inodes[index];
+    inode_block_dirty[index / INODES_PER_BLOCK] = true;
+    pthread_mutex_unlock(&inode_table_lock);
+}
+
+void flush_inodes(void) {
+    pthread_mutex_lock(&inode_table_lock);
+    int i = 0;
+    while (i < INODE_TABLE_SIZE) {
+        if (!inode_block_dirty[i]) {
+            i++;
+            continue;
+        }
+        // write consecutive dirty blocks together
+        int run = 0;
+        while (i + run < INODE_TABLE_SIZE && inode_block_dirty[i + run]) {
+            inode_block_dirty[i + run] = false;
+            run++;
         }
+        sync_inode_blocks(&table_image, i, run);
+        i += run;
     }
+    pthread_mutex_unlock(&inode_table_lock);
+}
+
+static int allocate_contiguous(int);
+
+static int index_credits(int);
+
+/*
+ * Disks made before version 4 have 64 byte inodes with a single indirect
+ * block. The old table is too small for the current inodes: they are
+ * converted and written to free data blocks, the super block then points at
+ * them
+ */
+static void relocate_inode_table(void) {
+    legacy_inode *old = malloc(sizeof(legacy_inode) * LEGACY_INODE_COUNT);
+    load_legacy_inodes(old);
+    for (int i = 0; i < INODE_COUNT; i++) {
+        inode *node = &inode_tb->inodes[i];
+        memset(node, 0, sizeof(inode));
+        node->mode = old[i].mode;
+        node->link_cnt = old[i].link_cnt;
+        node->size = old[i].size;
+        memcpy(node->direct, old[i].direct, sizeof(node->direct));
+        node->indirect = old[i].indirect;
+        node->double_indirect = -1;
+        node->triple_indirect = -1;
+    }
+    free(old);
+
+    int size = divide_round_up(INODE_COUNT * sizeof(inode), BLOCK_SIZE);
+    int start = allocate_contiguous(size);
+    if (start < 0) {
+        printf("No room left to move the inode table of the disk\n");
+        exit(EXIT_FAILURE);
+    }
+    flush_fbm();
+    geometry.inode_table_address = DATA_BLOCK_ADDRESS + start;
+    geometry.inode_table_size = size;
+    sync_inodes(inode_tb);
 }
 
 void init_inode_table(void) {
+    // sized for the geometry of the disk
+    for (int i = 0; i < inode_lock_count; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+        pthread_mutex_destroy(&extent_maps[i].lock);
+        free(extent_maps[i].extents);
+    }
+    free(inode_locks);
+    free(extent_maps);
+    inode_locks = malloc(sizeof(pthread_rwlock_t) * INODE_COUNT);
+    extent_maps = calloc(INODE_COUNT, sizeof(extent_map));
+    for (int i = 0; i < INODE_COUNT; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+        pthread_mutex_init(&extent_maps[i].lock, NULL);
+    }
+    inode_lock_count = INODE_COUNT;
     if (inode_tb == NULL)
-        inode_tb = (inode_table *)malloc(sizeof(inode_table));
-    load_inodes(inode_tb);
+        inode_tb = (inode_table *)calloc(1, sizeof(inode_table));
+    free(inode_tb->inodes);
+    inode_tb->inodes = malloc(sizeof(inode) * INODE_COUNT);
+
+    super_block block;
+    load_super_block(&block);
+    if (block.version < SFS_VERSION_GEOMETRY)
+        relocate_inode_table();
+    else
+        load_inodes(inode_tb);
+    if (block.version < SFS_VERSION)
+        init_super_block();
+
+    free(inode_block_dirty);
+    inode_block_dirty = calloc(INODE_TABLE_SIZE, sizeof(bool));
+    free(table_image.inodes);
+    table_image.inodes = malloc(sizeof(inode) * INODE_COUNT);
+    memcpy(table_image.inodes, inode_tb->inodes, sizeof(inode) * INODE_COUNT);
+
+    free(free_inodes);
+    free_inodes = malloc(sizeof(int) * INODE_COUNT);
+    free_inode_head = 0;
+    free_inode_count = 0;
+    for (int i = 0; i < INODE_COUNT; i++) {
+        if (inode_tb->inodes[i].mode == INODE_MODE_UNUSED)
+            free_inodes[free_inode_count++] = i;
+    }
 }
 
-void init_fbm(bool fresh) {
-    if (free_bm == NULL)
-        free_bm = (free_byte_map *)malloc(sizeof(free_byte_map));
-    if (fresh) {
+static void set_block_used(int block, bool used) {
+    int word = block / 64;
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if (used)
+        free_bm->words[word] |= bit;
+    else
+        free_bm->words[word] &= ~bit;
+    region_free[word / FREE_BITMAP_REGION_WORDS] += used ? -1 : 1;
+    free_block_count += used ? -1 : 1;
+    fbm_block_dirty[word / FREE_BITMAP_WORDS_PER_BLOCK] = true;
+}
+
+static void count_free_blocks(void) {
+    // the bits past the last data block are never free
+    int tail = DATA_BLOCK_SIZE % 64;
+    if (tail > 0)
+        free_bm->words[FREE_BITMAP_WORDS - 1] |= ~(uint64_t)0 << tail;
+
+    for (int i = 0; i < FREE_BITMAP_REGIONS; i++) {
+        region_free[i] = 0;
+    }
+    free_block_count = 0;
+    for (int i = 0; i < FREE_BITMAP_WORDS; i++) {
+        int free_bits = 64 - __builtin_popcountll(free_bm->words[i]);
+        region_free[i / FREE_BITMAP_REGION_WORDS] += free_bits;
+        free_block_count += free_bits;
+    }
+}
+
+/*
+ * Free blocks that no other write buffer reserved (allocator lock held)
+ */
+static int unreserved_blocks(void) {
+    return free_block_count - (reserved_blocks - own_reserved);
+}
+
+/*
+ * Blocks taken from the fbm come out of the reservation of a flush first
+ */
+static void take_reserved(int count) {
+    int used = min(count, own_reserved);
+    own_reserved -= used;
+    reserved_blocks -= used;
+}
+
+/*
+ * Blocks a write buffer reserves: the file blocks it can span and their
+ * index blocks
+ */
+static int buffer_reservation(void) {
+    int blocks = WRITE_BUFFER_SIZE / BLOCK_SIZE + 2;
+    return blocks + index_credits(blocks);
+}
+
+/*
+ * Reserves free blocks, returns false if too few are left
+ */
+static bool reserve_blocks(int count) {
+    pthread_mutex_lock(&alloc_lock);
+    bool reserved = unreserved_blocks() >= count;
+    if (reserved)
+        reserved_blocks += count;
+    pthread_mutex_unlock(&alloc_lock);
+    return reserved;
+}
+
+static void unreserve_blocks(int count) {
+    pthread_mutex_lock(&alloc_lock);
+    reserved_blocks -= count;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Converts the version 0 free byte map ('0'/'1' per block) into the bitmap.
+ * If the bitmap was already written by an interrupted migration the region
+ * no longer holds only '0'/'1' bytes and it is loaded as is.
+ */
+static void migrate_byte_map(void) {
+    free_byte_map *byte_map = (free_byte_map *)malloc(sizeof(free_byte_map));
+    load_byte_map(byte_map);
+
+    bool is_byte_map = true;
+    for (int i = 0; i < DATA_BLOCK_SIZE; i++) {
+        if (byte_map->map[i] != '0' && byte_map->map[i] != '1') {
+            is_byte_map = false;
+            break;
+        }
+    }
+
+    if (is_byte_map) {
+        memset(free_bm->words, 0, FREE_BITMAP_BYTES);
         for (int i = 0; i < DATA_BLOCK_SIZE; i++) {
-            free_bm->map[i] = '0';
+            if (byte_map->map[i] == '1')
+                free_bm->words[i / 64] |= (uint64_t)1 << (i % 64);
         }
+        count_free_blocks();
         sync_fbm(free_bm);
     } else {
         load_fbm(free_bm);
     }
+    free(byte_map);
 }
 
-void init_fd_table(void) {
-    if (fd_table == NULL)
-        fd_table =
-            (file_descriptor_table *)malloc(sizeof(file_descriptor_table));
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
-        file_descriptor *fd = get_fd(i);
-        fd->inode = -1;
-        fd->op_pointer = 0;
+/*
+ * Journal commit hook: the frees of every pending block are committed now
+ * (no operation is halfway through its changes during a commit)
+ */
+static void reclaim_committed(void) {
+    pthread_mutex_lock(&alloc_lock);
+    memcpy(reclaim_ready->words, reclaim_bm->words, FREE_BITMAP_BYTES);
+    reclaim_ready_count = reclaim_pending;
+    for (int i = 0; i < reclaim_busy_count; i++) {
+        for (int j = 0; j < reclaim_busy[i].length; j++) {
+            int block = reclaim_busy[i].start + j;
+            reclaim_ready->words[block / 64] &= ~((uint64_t)1 << (block % 64));
+        }
+        reclaim_ready_count -= reclaim_busy[i].length;
     }
+    if (reclaim_ready_count > 0)
+        pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-void init_root_dir_cache(void) {
-    if (root_directory == NULL)
-        root_directory = (directory *)malloc(sizeof(directory));
-    clear_root_dir();
+static int read_scrub_mode(void) {
+    const char *env = getenv(RECLAIM_SCRUB_ENV);
+    if (env != NULL && strcmp(env, "none") == 0)
+        return SCRUB_NONE;
+    if (env != NULL && strcmp(env, "zero") == 0)
+        return SCRUB_ZERO;
+    return SCRUB_PUNCH;
 }
 
-directory_entry *find_dir_entry(const char *name) {
-    char str[MAX_FILE_NAME_SIZE];
-    memcpy(str, name, MAX_FILE_NAME_SIZE);
-    str[MAX_FILE_NAME_SIZE - 1] = '\0';
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
-        directory_entry *entry = get_dir_entry(i);
-        if (entry->inode > 0 && strcmp(str, entry->name) == 0) {
-            return entry;
+/*
+ * Sizes a bitmap for the geometry of the disk
+ */
+static free_bitmap *resize_bitmap(free_bitmap *map) {
+    if (map == NULL)
+        map = (free_bitmap *)calloc(1, sizeof(free_bitmap));
+    free(map->words);
+    map->words = malloc(FREE_BITMAP_BYTES);
+    return map;
+}
+
+void init_fbm(bool fresh) {
+    free_bm = resize_bitmap(free_bm);
+    reclaim_bm = resize_bitmap(reclaim_bm);
+    reclaim_ready = resize_bitmap(reclaim_ready);
+    free(region_free);
+    free(fbm_block_dirty);
+    free(reclaim_block_dirty);
+    region_free = malloc(sizeof(int) * FREE_BITMAP_REGIONS);
+    fbm_block_dirty = malloc(sizeof(bool) * FREE_BITMAP_SIZE);
+    reclaim_block_dirty = malloc(sizeof(bool) * RECLAIM_MAP_SIZE);
+    if (fresh) {
+        memset(free_bm->words, 0, FREE_BITMAP_BYTES);
+        memset(reclaim_bm->words, 0, FREE_BITMAP_BYTES);
+        // a fresh disk reads as 0's, which is already an empty bitmap
+        count_free_blocks();
+    } else {
+        super_block block;
+        load_super_block(&block);
+        if (block.version < SFS_VERSION_BITMAP)
+            migrate_byte_map();
+        else
+            load_fbm(free_bm);
+        count_free_blocks();
+
+        // older disks kept byte map leftovers where the reclaim map now is
+        if (block.version < SFS_VERSION_RECLAIM) {
+            memset(reclaim_bm->words, 0, FREE_BITMAP_BYTES);
+            sync_reclaim_map_blocks(reclaim_bm, 0, RECLAIM_MAP_SIZE);
+        } else {
+            load_reclaim_map(reclaim_bm);
+        }
+        // init_inode_table moves the super block to the current version
+    }
+
+    /*
+     * a block marked free was already released (the reclaim map was not
+     * persisted after it) and may be reused, it must not be scrubbed
+     */
+    reclaim_pending = 0;
+    for (int i = 0; i < FREE_BITMAP_WORDS; i++) {
+        reclaim_bm->words[i] &= free_bm->words[i];
+        reclaim_pending += __builtin_popcountll(reclaim_bm->words[i]);
+    }
+    // everything on the disk is committed
+    memcpy(reclaim_ready->words, reclaim_bm->words, FREE_BITMAP_BYTES);
+    reclaim_ready_count = reclaim_pending;
+    reclaim_busy_count = 0;
+    journal_set_commit_hook(reclaim_committed);
+    for (int i = 0; i < FREE_BITMAP_SIZE; i++) {
+        fbm_block_dirty[i] = false;
+        reclaim_block_dirty[i] = false;
+    }
+    alloc_hint = 0;
+    reserved_blocks = 0;
+    scrub_mode = read_scrub_mode();
+}
+
+static void flush_bitmap(free_bitmap *map, bool *dirty,
+                         void (*sync)(free_bitmap *, int, int)) {
+    int i = 0;
+    while (i < FREE_BITMAP_SIZE) {
+        if (!dirty[i]) {
+            i++;
+            continue;
+        }
+        // write consecutive dirty blocks together
+        int run = 0;
+        while (i + run < FREE_BITMAP_SIZE && dirty[i + run]) {
+            dirty[i + run] = false;
+            run++;
+        }
+        sync(map, i, run);
+        i += run;
+    }
+}
+
+void flush_fbm(void) {
+    free_bitmap fbm_copy = {malloc(FREE_BITMAP_BYTES)};
+    free_bitmap reclaim_copy = {malloc(FREE_BITMAP_BYTES)};
+    bool fbm_dirty[FREE_BITMAP_SIZE];
+    bool reclaim_dirty[RECLAIM_MAP_SIZE];
+
+    /*
+     * copy the maps under the lock and write them outside it, the journal
+     * takes the allocator lock when it commits
+     */
+    pthread_mutex_lock(&alloc_lock);
+    memcpy(fbm_copy.words, free_bm->words, FREE_BITMAP_BYTES);
+    memcpy(reclaim_copy.words, reclaim_bm->words, FREE_BITMAP_BYTES);
+    for (int i = 0; i < FREE_BITMAP_SIZE; i++) {
+        fbm_dirty[i] = fbm_block_dirty[i];
+        reclaim_dirty[i] = reclaim_block_dirty[i];
+        fbm_block_dirty[i] = false;
+        reclaim_block_dirty[i] = false;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    /*
+     * bitmap first: a crash in between leaves released blocks pending, which
+     * init_fbm drops, instead of leaking them
+     */
+    flush_bitmap(&fbm_copy, fbm_dirty, sync_fbm_blocks);
+    flush_bitmap(&reclaim_copy, reclaim_dirty, sync_reclaim_map_blocks);
+    free(fbm_copy.words);
+    free(reclaim_copy.words);
+}
+
+static void set_block_pending(int block, bool pending) {
+    int word = block / 64;
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if (pending) {
+        reclaim_bm->words[word] |= bit;
+    } else {
+        reclaim_bm->words[word] &= ~bit;
+        if (reclaim_ready->words[word] & bit)
+            reclaim_ready_count--;
+        reclaim_ready->words[word] &= ~bit;
+    }
+    reclaim_pending += pending ? 1 : -1;
+    reclaim_block_dirty[word / FREE_BITMAP_WORDS_PER_BLOCK] = true;
+}
+
+/*
+ * Takes ready blocks out of the reclaim map as runs of consecutive blocks,
+ * within RECLAIM_BATCH_MAP_BLOCKS bitmap blocks (called with the allocator
+ * lock held). Returns the number of runs
+ */
+static int take_ready_runs(extent *runs, int max_runs) {
+    int run_count = 0;
+    int last_word = FREE_BITMAP_WORDS;
+    for (int word = 0; word < last_word && run_count < max_runs; word++) {
+        uint64_t bits = reclaim_ready->words[word];
+        if (bits != 0 && last_word == FREE_BITMAP_WORDS)
+            last_word = min(FREE_BITMAP_WORDS,
+                            (word / FREE_BITMAP_WORDS_PER_BLOCK +
+                             RECLAIM_BATCH_MAP_BLOCKS) *
+                                FREE_BITMAP_WORDS_PER_BLOCK);
+        while (bits != 0 && run_count < max_runs) {
+            int block = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            reclaim_ready->words[word] &= ~((uint64_t)1 << (block % 64));
+            reclaim_ready_count--;
+            if (run_count > 0 && runs[run_count - 1].start +
+                                         runs[run_count - 1].length ==
+                                     block) {
+                runs[run_count - 1].length++;
+                continue;
+            }
+            runs[run_count].start = block;
+            runs[run_count].length = 1;
+            run_count++;
         }
     }
+    return run_count;
+}
+
+static void scrub_run(extent run) {
+    if (scrub_mode == SCRUB_PUNCH)
+        discard_data_blocks(run.start, run.length);
+    else if (scrub_mode == SCRUB_ZERO)
+        zero_data_blocks(run.start, run.length);
+}
+
+/*
+ * Drains the reclaim map: scrubs ready blocks outside the lock (nobody can
+ * allocate them yet) and then marks them free. A batch is one operation, its
+ * bitmap blocks are logged before it ends
+ */
+static void *reclaim_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&alloc_lock);
+    while (!reclaim_stop) {
+        if (reclaim_ready_count == 0) {
+            pthread_cond_wait(&reclaim_cond, &alloc_lock);
+            continue;
+        }
+        // the journal takes the allocator lock when it commits
+        pthread_mutex_unlock(&alloc_lock);
+        int status = journal_begin_op(2 * RECLAIM_BATCH_MAP_BLOCKS);
+        pthread_mutex_lock(&alloc_lock);
+        if (status < 0) {
+            // the journal fails, wait for the next commit or the stop
+            pthread_cond_wait(&reclaim_cond, &alloc_lock);
+            continue;
+        }
+        reclaim_busy_count = take_ready_runs(reclaim_busy, RECLAIM_BATCH);
+        pthread_mutex_unlock(&alloc_lock);
+        for (int i = 0; i < reclaim_busy_count; i++) {
+            scrub_run(reclaim_busy[i]);
+        }
+        pthread_mutex_lock(&alloc_lock);
+        for (int i = 0; i < reclaim_busy_count; i++) {
+            for (int j = 0; j < reclaim_busy[i].length; j++) {
+                set_block_pending(reclaim_busy[i].start + j, false);
+                set_block_used(reclaim_busy[i].start + j, false);
+            }
+        }
+        reclaim_busy_count = 0;
+        pthread_cond_broadcast(&reclaim_done);
+        pthread_mutex_unlock(&alloc_lock);
+        flush_fbm();
+        journal_end_op();
+        pthread_mutex_lock(&alloc_lock);
+    }
+    pthread_mutex_unlock(&alloc_lock);
     return NULL;
 }
 
-void load_root_dir(void) {
-    inode *root_inode = get_root_inode();
-    int entries_size = sizeof(directory);
-    int max_bytes = MAX_DIR_BYTES_PER_BLOCK;
-    char buf[PRE_ALLOCATED_DIR_BLOCKS * max_bytes];
-    for (int i = 0; i < PRE_ALLOCATED_DIR_BLOCKS; i++) {
-        char block[max_bytes];
-        load_data_block(root_inode->direct[i], block, max_bytes);
-        memcpy(buf + (i * max_bytes), block, max_bytes);
+static worker_fork_state reclaim_fork = {
+    {&alloc_lock, NULL}, {&reclaim_cond, &reclaim_done}, &reclaim_running};
+
+void start_reclaim(void) {
+    register_worker_fork(&reclaim_fork);
+    if (reclaim_running)
+        return;
+    reclaim_stop = false;
+    if (pthread_create(&reclaim_thread, NULL, reclaim_worker, NULL) == 0)
+        reclaim_running = true;
+}
+
+void stop_reclaim(void) {
+    if (!reclaim_running)
+        return;
+    pthread_mutex_lock(&alloc_lock);
+    reclaim_stop = true;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_join(reclaim_thread, NULL);
+    reclaim_running = false;
+}
+
+void init_write_buffers(void) {
+    if (write_buffer_pool == NULL)
+        write_buffer_pool = malloc(sizeof(write_buffer) * WRITE_BUFFER_COUNT);
+    pthread_mutex_lock(&write_buffer_lock);
+    // sized for the geometry of the disk
+    free(write_buffer_data);
+    free(write_buffers);
+    write_buffer_data = malloc((size_t)WRITE_BUFFER_COUNT * WRITE_BUFFER_SIZE);
+    write_buffers = calloc(INODE_COUNT, sizeof(write_buffer *));
+    for (int i = 0; i < WRITE_BUFFER_COUNT; i++) {
+        write_buffer_pool[i].data =
+            write_buffer_data + (size_t)i * WRITE_BUFFER_SIZE;
+        write_buffer_used[i] = false;
     }
-    memcpy(root_directory->entries, buf, entries_size);
+    pthread_mutex_unlock(&write_buffer_lock);
 }
 
-void sync_root_dir(void) {
-    inode *root_inode = get_root_inode();
-    int size = PRE_ALLOCATED_DIR_BLOCKS * BLOCK_SIZE;
-    char *buf = malloc(size);
-    clear_buffer(buf, size);
-    int found = 0;
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
-        directory_entry *entry = get_dir_entry(i);
-        if (entry->inode > 0) {
-            memcpy(buf + (found++ * sizeof(directory_entry)), entry,
-                   sizeof(directory_entry));
+write_buffer *get_write_buffer(int inode_index) {
+    return write_buffers[inode_index];
+}
+
+write_buffer *attach_write_buffer(int inode_index) {
+    int reservation = buffer_reservation();
+    if (!reserve_blocks(reservation))
+        return NULL;
+    pthread_mutex_lock(&write_buffer_lock);
+    write_buffer *buffer = NULL;
+    for (int i = 0; i < WRITE_BUFFER_COUNT; i++) {
+        if (!write_buffer_used[i]) {
+            write_buffer_used[i] = true;
+            buffer = &write_buffer_pool[i];
+            buffer->start = 0;
+            buffer->length = 0;
+            buffer->reserved = reservation;
+            break;
         }
     }
+    write_buffers[inode_index] = buffer;
+    pthread_mutex_unlock(&write_buffer_lock);
+    if (buffer == NULL)
+        unreserve_blocks(reservation);
+    return buffer;
+}
+
+void release_write_buffer(int inode_index) {
+    int reserved = 0;
+    pthread_mutex_lock(&write_buffer_lock);
+    write_buffer *buffer = write_buffers[inode_index];
+    if (buffer != NULL) {
+        reserved = buffer->reserved;
+        write_buffer_used[buffer - write_buffer_pool] = false;
+        write_buffers[inode_index] = NULL;
+    }
+    pthread_mutex_unlock(&write_buffer_lock);
+    if (reserved > 0)
+        unreserve_blocks(reserved);
+}
+
+void begin_buffer_flush(int inode_index) {
+    own_reserved = write_buffers[inode_index]->reserved;
+}
+
+void end_buffer_flush(int inode_index, bool written) {
+    write_buffer *buffer = write_buffers[inode_index];
+    pthread_mutex_lock(&alloc_lock);
+    if (written) {
+        // what the flush did not take goes back
+        reserved_blocks -= own_reserved;
+        buffer->reserved = 0;
+    } else {
+        // the blocks it took are freed again, the next try needs them all
+        reserved_blocks += buffer->reserved - own_reserved;
+    }
+    own_reserved = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-    for (int i = 0; i < PRE_ALLOCATED_DIR_BLOCKS; i++) {
-        sync_data_block(root_inode->direct[i],
-                        buf + (i * MAX_DIR_BYTES_PER_BLOCK),
-                        MAX_DIR_BYTES_PER_BLOCK);
+int buffered_inodes(int *inodes) {
+    int count = 0;
+    pthread_mutex_lock(&write_buffer_lock);
+    for (int i = 0; i < INODE_COUNT && count < WRITE_BUFFER_COUNT; i++) {
+        if (write_buffers[i] != NULL)
+            inodes[count++] = i;
+    }
+    pthread_mutex_unlock(&write_buffer_lock);
+    return count;
+}
+
+void init_fd_table(void) {
+    if (fd_table == NULL)
+        fd_table =
+            (file_descriptor_table *)calloc(1, sizeof(file_descriptor_table));
+    free(fd_table->entries);
+    fd_table->entries =
+        malloc(sizeof(file_descriptor) * MAX_NUMBER_OF_DIRECTORY_ENTRIES);
+    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
+        file_descriptor *fd = get_fd(i);
+        fd->inode = -1;
+        fd->op_pointer = 0;
+        fd->unlinked = false;
+        fd->ra_offset = 0;
+        fd->ra_window = 0;
+        fd->ra_end = 0;
     }
-    free(buf);
 }
 
 int create_inode(void) {
+    pthread_mutex_lock(&inode_table_lock);
     int inode_index = -1;
-    for (int i = 0; i < INODE_COUNT; i++) {
-        if (inode_tb->inodes[i].mode == INODE_MODE_UNUSED) {
-            inode_index = i;
-            break;
-        }
+    if (free_inode_count > 0) {
+        inode_index = free_inodes[free_inode_head];
+        free_inode_head = (free_inode_head + 1) % INODE_COUNT;
+        free_inode_count--;
     }
+    pthread_mutex_unlock(&inode_table_lock);
     if (inode_index < 0) {
         printf("Maximum number of files has been reached\n");
         return -1;
     }
-    inode *node = get_inode(inode_index);
+    inode *node = &inode_tb->inodes[inode_index];
+    memset(node, 0, sizeof(inode));
     node->mode = INODE_MODE_USED;
     node->size = 0;
     node->indirect = -1;
+    node->double_indirect = -1;
+    node->triple_indirect = -1;
     node->link_cnt = -1;
 
     clear_array(node->direct, INODE_DIRECT_BLOCK_COUNT);
+    mark_inode_dirty(inode_index);
+
+    // nothing is mapped yet
+    extent_map *map = &extent_maps[inode_index];
+    pthread_mutex_lock(&map->lock);
+    map->count = 0;
+    map->loaded = true;
+    pthread_mutex_unlock(&map->lock);
 
     return inode_index;
 }
 
 int delete_inode(int inode_index) {
     inode *file_inode = get_inode(inode_index);
-    if (file_inode == NULL)
+    if (file_inode == NULL || file_inode->mode == INODE_MODE_UNUSED)
         return -1;
+
     file_inode->size = 0;
     file_inode->mode = INODE_MODE_UNUSED;
     file_inode->link_cnt = -1;
+    free_file_blocks(file_inode, 0);
 
-    int blocks_to_free[DATA_BLOCKS_PER_FILE];
-    clear_array(blocks_to_free, DATA_BLOCKS_PER_FILE);
-    int blocks_used = get_inode_data_blocks(file_inode, blocks_to_free);
-    if (file_inode->indirect > -1)
-        blocks_to_free[blocks_used++] = file_inode->indirect;
-    free_used_blocks(blocks_used, blocks_to_free);
-    clear_array(file_inode->direct, INODE_DIRECT_BLOCK_COUNT);
-    sync_inodes(inode_tb);
+    pthread_mutex_lock(&inode_table_lock);
+    free_inodes[(free_inode_head + free_inode_count) % INODE_COUNT] =
+        inode_index;
+    free_inode_count++;
+    pthread_mutex_unlock(&inode_table_lock);
     return 0;
 }
 
-int get_inode_data_blocks(inode *node, int *buf) {
-    int blocks_used = 0;
-    for (int i = 0; i < INODE_DIRECT_BLOCK_COUNT; ++i) {
-        if (node->direct[i] < 0)
-            return blocks_used;
-        buf[blocks_used++] = node->direct[i];
+/*
+ * Index blocks on the way to a file block, one per level of the tree that
+ * maps it. Consecutive file blocks share their index blocks, a block is only
+ * loaded (and a changed one written) when the walk moves past it
+ */
+typedef struct {
+    inode *node;
+    int address[INDIRECT_LEVELS];
+    bool dirty[INDIRECT_LEVELS];
+    int *blocks[INDIRECT_LEVELS];
+    int leaf; // level holding the last slot returned, -1 for the inode
+    int goal; // where new index blocks are allocated
+} block_path;
+
+static void open_path(block_path *path, inode *node) {
+    path->node = node;
+    for (int i = 0; i < INDIRECT_LEVELS; i++) {
+        path->address[i] = -1;
+        path->dirty[i] = false;
+        path->blocks[i] = malloc(BLOCK_SIZE);
     }
+    path->leaf = -1;
+    path->goal = -1;
+}
 
-    if (node->indirect < 0)
-        return blocks_used;
+static void write_path_block(block_path *path, int level) {
+    if (path->dirty[level])
+        sync_index_block(path->address[level], path->blocks[level]);
+    path->dirty[level] = false;
+}
 
-    index_block index_b;
-    load_index_block(node->indirect, &index_b);
-    for (int i = 0; i < INDEX_BLOCK_NUM_POINTER; ++i) {
-        if (index_b.data[i] < 0)
-            return blocks_used;
-        buf[blocks_used++] = index_b.data[i];
+static void close_path(block_path *path) {
+    for (int i = 0; i < INDIRECT_LEVELS; i++) {
+        write_path_block(path, i);
+        free(path->blocks[i]);
     }
-    return blocks_used;
 }
 
-void update_inode_data_blocks(inode *node, const int *buf) {
-    int blocks_used = 0;
-    for (int i = 0; i < DATA_BLOCKS_CONTENT_PER_FILE; ++i) {
-        if (buf[i] > -1)
-            blocks_used++;
+static void mark_slot_dirty(block_path *path) {
+    if (path->leaf < 0)
+        mark_inode_dirty(get_inode_index(path->node));
+    else
+        path->dirty[path->leaf] = true;
+}
+
+/*
+ * Returns the pointer to the data block of file block b, in the inode or in
+ * an index block of the path. Returns NULL when an index block on the way is
+ * missing, unless allocate is set (then only when the disk is full)
+ */
+static int *block_slot(block_path *path, int b, bool allocate) {
+    inode *node = path->node;
+    path->leaf = -1;
+    if (b < INODE_DIRECT_BLOCK_COUNT)
+        return &node->direct[b];
+
+    // find the tree holding the block, span is the number of file blocks
+    // under one pointer of its top index block
+    int *roots[INDIRECT_LEVELS] = {&node->indirect, &node->double_indirect,
+                                   &node->triple_indirect};
+    long pointers = INDEX_BLOCK_NUM_POINTER;
+    long rel = b - INODE_DIRECT_BLOCK_COUNT;
+    long span = 1;
+    int depth = 0;
+    while (rel >= span * pointers) {
+        rel -= span * pointers;
+        span *= pointers;
+        if (++depth == INDIRECT_LEVELS)
+            return NULL;
     }
 
-    int blocks_copied = 0;
-    int up_bound = min(INODE_DIRECT_BLOCK_COUNT, blocks_used);
+    int *slot = roots[depth];
+    for (int level = 0; level <= depth; level++) {
+        if (*slot < 0) {
+            if (!allocate)
+                return NULL;
+            extent index_extent;
+            if (allocate_extents(path->goal, SINGLE_BLOCK, &index_extent, 1) <
+                1)
+                return NULL;
+            *slot = index_extent.start;
+            mark_slot_dirty(path);
+            write_path_block(path, level);
+            clear_index_block(path->blocks[level]);
+            path->address[level] = *slot;
+            path->dirty[level] = true;
+        } else if (path->address[level] != *slot) {
+            write_path_block(path, level);
+            load_index_block(*slot, path->blocks[level]);
+            path->address[level] = *slot;
+        }
+        slot = &path->blocks[level][(rel / span) % pointers];
+        span /= pointers;
+        path->leaf = level;
+    }
+    return slot;
+}
+
+/*
+ * Makes room for one more extent at index i
+ */
+static void insert_extent_slot(extent_map *map, int i) {
+    if (map->count == map->capacity) {
+        map->capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+        map->extents =
+            realloc(map->extents, sizeof(block_extent) * map->capacity);
+    }
+    memmove(&map->extents[i + 1], &map->extents[i],
+            sizeof(block_extent) * (map->count - i));
+    map->count++;
+}
 
-    for (int j = 0; j < up_bound; ++j) {
-        node->direct[j] = buf[blocks_copied++];
+static void append_extent(extent_map *map, int file_block, int block,
+                          int length) {
+    if (map->count > 0) {
+        block_extent *last = &map->extents[map->count - 1];
+        if (last->file_block + last->length == file_block &&
+            last->block + last->length == block) {
+            last->length += length;
+            return;
+        }
     }
+    insert_extent_slot(map, map->count);
+    map->extents[map->count - 1] = (block_extent){file_block, block, length};
+}
 
-    if (blocks_copied >= blocks_used) {
-        sync_inodes(inode_tb);
+/*
+ * Adds what the subtree under a pointer maps to the extent map, in file
+ * order (levels and base as in free_tree)
+ */
+static void load_tree(extent_map *map, int pointer, int levels, long base) {
+    if (pointer < 0)
         return;
+    if (levels == 0) {
+        append_extent(map, (int)base, pointer, 1);
+        return;
+    }
+    long child_span = 1;
+    for (int i = 1; i < levels; i++) {
+        child_span *= INDEX_BLOCK_NUM_POINTER;
+    }
+    int *index = malloc(BLOCK_SIZE);
+    load_index_block(pointer, index);
+    for (int i = 0; i < INDEX_BLOCK_NUM_POINTER; i++) {
+        load_tree(map, index[i], levels - 1, base + i * child_span);
     }
+    free(index);
+}
 
-    index_block index_b;
-    clear_array(index_b.data, INDEX_BLOCK_NUM_POINTER);
+/*
+ * Returns the extent map of the inode with its lock held, resolving the
+ * block tree the first time
+ */
+static extent_map *lock_extent_map(inode *node) {
+    extent_map *map = &extent_maps[get_inode_index(node)];
+    pthread_mutex_lock(&map->lock);
+    if (map->loaded)
+        return map;
+    COUNT(bmap_loads, 1);
+    map->count = 0;
+    for (int i = 0; i < INODE_DIRECT_BLOCK_COUNT; i++) {
+        if (node->direct[i] >= 0)
+            append_extent(map, i, node->direct[i], 1);
+    }
+    int roots[INDIRECT_LEVELS] = {node->indirect, node->double_indirect,
+                                  node->triple_indirect};
+    long base = INODE_DIRECT_BLOCK_COUNT;
+    long span = 1;
+    for (int depth = 0; depth < INDIRECT_LEVELS; depth++) {
+        span *= INDEX_BLOCK_NUM_POINTER;
+        load_tree(map, roots[depth], depth + 1, base);
+        base += span;
+    }
+    map->loaded = true;
+    return map;
+}
+
+/*
+ * Index of the first extent that ends after file block b (count if none)
+ */
+static int find_extent(extent_map *map, int b) {
+    int low = 0;
+    int high = map->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        block_extent *e = &map->extents[mid];
+        if (e->file_block + e->length <= b)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
 
-    if (node->indirect < 0) {
-        node->indirect = find_one_unused_block();
+/*
+ * Unmaps file blocks [first, end) in the extent map, splitting the extents
+ * that reach past the range
+ */
+static void unmap_extents(extent_map *map, int first, long end) {
+    int i = find_extent(map, first);
+    if (i < map->count && map->extents[i].file_block < first &&
+        map->extents[i].file_block + map->extents[i].length > end) {
+        // the range is inside one extent, its tail becomes a new one
+        block_extent e = map->extents[i];
+        int cut = (int)(end - e.file_block);
+        map->extents[i].length = first - e.file_block;
+        insert_extent_slot(map, i + 1);
+        map->extents[i + 1] =
+            (block_extent){e.file_block + cut, e.block + cut, e.length - cut};
+        return;
     }
+    if (i < map->count && map->extents[i].file_block < first) {
+        map->extents[i].length = first - map->extents[i].file_block;
+        i++;
+    }
+    int j = i;
+    while (j < map->count &&
+           map->extents[j].file_block + map->extents[j].length <= end) {
+        j++;
+    }
+    if (j < map->count && map->extents[j].file_block < end) {
+        int cut = (int)(end - map->extents[j].file_block);
+        map->extents[j].file_block += cut;
+        map->extents[j].block += cut;
+        map->extents[j].length -= cut;
+    }
+    if (j > i) {
+        memmove(&map->extents[i], &map->extents[j],
+                sizeof(block_extent) * (map->count - j));
+        map->count -= j - i;
+    }
+}
 
-    int blocks_left = blocks_used - blocks_copied;
-    for (int i = 0; i < blocks_left; ++i) {
-        index_b.data[i] = buf[blocks_copied++];
+/*
+ * Maps a run of file blocks that is not mapped in the extent map, merging it
+ * with the extents around it
+ */
+static void map_extent(extent_map *map, int file_block, int block,
+                       int length) {
+    int i = find_extent(map, file_block);
+    if (i > 0) {
+        block_extent *prev = &map->extents[i - 1];
+        if (prev->file_block + prev->length == file_block &&
+            prev->block + prev->length == block) {
+            prev->length += length;
+            if (i < map->count &&
+                map->extents[i].file_block == file_block + length &&
+                map->extents[i].block == block + length) {
+                prev->length += map->extents[i].length;
+                memmove(&map->extents[i], &map->extents[i + 1],
+                        sizeof(block_extent) * (map->count - i - 1));
+                map->count--;
+            }
+            return;
+        }
     }
-    sync_inodes(inode_tb);
-    sync_index_block(node->indirect, &index_b);
+    if (i < map->count && map->extents[i].file_block == file_block + length &&
+        map->extents[i].block == block + length) {
+        map->extents[i].file_block = file_block;
+        map->extents[i].block = block;
+        map->extents[i].length += length;
+        return;
+    }
+    insert_extent_slot(map, i);
+    map->extents[i] = (block_extent){file_block, block, length};
 }
 
-int add_fd(int inode_index, int file_size) {
-    // check if exists
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; ++i) {
-        file_descriptor *fd = get_fd(i);
-        if (fd->inode == inode_index) {
-            fd->op_pointer = file_size;
-            return i;
+void map_file_blocks(inode *node, int first, int count, int *buf) {
+    COUNT(bmap_lookups, 1);
+    extent_map *map = lock_extent_map(node);
+    int i = find_extent(map, first);
+    int done = 0;
+    while (done < count) {
+        int b = first + done;
+        if (i == map->count || map->extents[i].file_block > b) {
+            // a hole up to the next extent
+            int end = i == map->count ? first + count
+                                      : min(map->extents[i].file_block,
+                                            first + count);
+            for (; b < end; b++) {
+                buf[done++] = -1;
+            }
+            continue;
+        }
+        block_extent *e = &map->extents[i];
+        int end = min(e->file_block + e->length, first + count);
+        for (; b < end; b++) {
+            buf[done++] = e->block + (b - e->file_block);
         }
+        i++;
     }
+    pthread_mutex_unlock(&map->lock);
+}
 
-    // add
-    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
+int set_file_blocks(inode *node, int first, int count, const int *buf) {
+    int status = 0;
+    // blocks that are already mapped there need no walk of the tree
+    int *mapped = malloc(sizeof(int) * (count > 0 ? count : 1));
+    map_file_blocks(node, first, count, mapped);
+    block_path path;
+    open_path(&path, node);
+    for (int i = 0; i < count; i++) {
+        if (buf[i] < 0 || buf[i] == mapped[i])
+            continue;
+        // index blocks go next to the data they map
+        path.goal = buf[i];
+        int *slot = block_slot(&path, first + i, true);
+        if (slot == NULL) {
+            status = -1;
+            break;
+        }
+        if (*slot != buf[i]) {
+            *slot = buf[i];
+            mark_slot_dirty(&path);
+        }
+    }
+    close_path(&path);
+
+    extent_map *map = lock_extent_map(node);
+    if (status < 0) {
+        // part of the range was mapped, resolved again on the next use
+        map->loaded = false;
+    } else {
+        int i = 0;
+        while (i < count) {
+            if (buf[i] < 0 || buf[i] == mapped[i]) {
+                i++;
+                continue;
+            }
+            int run = 1;
+            while (i + run < count && buf[i + run] == buf[i] + run &&
+                   buf[i + run] != mapped[i + run]) {
+                run++;
+            }
+            unmap_extents(map, first + i, (long)first + i + run);
+            map_extent(map, first + i, buf[i], run);
+            i += run;
+        }
+    }
+    pthread_mutex_unlock(&map->lock);
+    free(mapped);
+
+    flush_fbm();
+    flush_inodes();
+    return status;
+}
+
+/*
+ * Growable list of the blocks a truncate frees
+ */
+typedef struct {
+    int *blocks;
+    int count;
+    int capacity;
+} block_list;
+
+static void add_block(block_list *list, int block) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->blocks = realloc(list->blocks, sizeof(int) * list->capacity);
+    }
+    list->blocks[list->count++] = block;
+}
+
+/*
+ * Frees what the subtree under a pointer maps from file block first on.
+ * levels is the number of index blocks from the pointer down to the data
+ * (0 when it points at a data block) and base the first file block under it.
+ * An index block that keeps some blocks is rewritten, returns true when the
+ * pointer was cleared
+ */
+static bool free_tree(int *slot, int levels, long base, long first,
+                      block_list *freed) {
+    long span = 1;
+    for (int i = 0; i < levels; i++) {
+        span *= INDEX_BLOCK_NUM_POINTER;
+    }
+    if (*slot < 0 || base + span <= first)
+        return false;
+    if (levels > 0) {
+        long child_span = span / INDEX_BLOCK_NUM_POINTER;
+        int *index = malloc(BLOCK_SIZE);
+        load_index_block(*slot, index);
+        bool changed = false;
+        for (int i = 0; i < INDEX_BLOCK_NUM_POINTER; i++) {
+            if (free_tree(&index[i], levels - 1, base + i * child_span, first,
+                          freed))
+                changed = true;
+        }
+        if (base < first && changed)
+            sync_index_block(*slot, index);
+        free(index);
+        if (base < first)
+            return false;
+    }
+    add_block(freed, *slot);
+    *slot = -1;
+    return true;
+}
+
+void free_file_blocks(inode *node, int first) {
+    extent_map *map = lock_extent_map(node);
+    unmap_extents(map, first, (long)INT_MAX + 1);
+    pthread_mutex_unlock(&map->lock);
+
+    block_list freed = {NULL, 0, 0};
+    for (int i = first; i < INODE_DIRECT_BLOCK_COUNT; i++) {
+        if (node->direct[i] >= 0)
+            add_block(&freed, node->direct[i]);
+        node->direct[i] = -1;
+    }
+    int *roots[INDIRECT_LEVELS] = {&node->indirect, &node->double_indirect,
+                                   &node->triple_indirect};
+    long base = INODE_DIRECT_BLOCK_COUNT;
+    long span = 1;
+    for (int depth = 0; depth < INDIRECT_LEVELS; depth++) {
+        span *= INDEX_BLOCK_NUM_POINTER;
+        free_tree(roots[depth], depth + 1, base, first, &freed);
+        base += span;
+    }
+
+    // the inode must stop pointing at the blocks before they are released
+    mark_inode_dirty(get_inode_index(node));
+    flush_inodes();
+    free_used_blocks(freed.count, freed.blocks);
+    free(freed.blocks);
+}
+
+int free_step_start(inode *node, int first, int count) {
+    extent_map *map = lock_extent_map(node);
+    long end = first;
+    if (map->count > 0) {
+        block_extent *last = &map->extents[map->count - 1];
+        end = last->file_block + last->length;
+    }
+    pthread_mutex_unlock(&map->lock);
+    return end - count > first ? (int)(end - count) : first;
+}
+
+/*
+ * Index blocks of the trees under count consecutive file blocks (a bound, the
+ * partly covered ones at both ends included)
+ */
+static int index_credits(int count) {
+    return INDIRECT_LEVELS * (count / INDEX_BLOCK_NUM_POINTER + 3);
+}
+
+int map_credits(int count) {
+    // the inode, the index blocks written (or revoked when the mapping
+    // fails) and the fbm and reclaim map blocks of the blocks taken
+    int index = index_credits(count);
+    return 1 + 2 * index + 2 * min(count + index, FREE_BITMAP_SIZE);
+}
+
+int free_credits(int count, bool dir) {
+    // the inode, the index blocks rewritten or revoked, the directory blocks
+    // revoked and the reclaim map blocks of the freed blocks
+    int index = index_credits(count);
+    return 1 + 2 * index + (dir ? count : 0) +
+           min(count + index, RECLAIM_MAP_SIZE);
+}
+
+int add_fd(int inode_index, long file_size) {
+    int index = -1;
+    lock_fd_table();
+    for (int i = 0; index < 0 && i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
         file_descriptor *fd = get_fd(i);
         if (fd->inode == -1) {
             fd->inode = inode_index;
             fd->op_pointer = file_size;
-            return i;
+            fd->unlinked = false;
+            // a first read at the start of the file counts as sequential
+            fd->ra_offset = 0;
+            fd->ra_window = 0;
+            fd->ra_end = 0;
+            index = i;
         }
     }
-    return -1;
+    unlock_fd_table();
+    return index;
 }
 
-int find_unused_blocks(int number_blocks, int *blocks) {
-    int blocks_found = 0;
-    for (int i = 0; i < DATA_BLOCK_SIZE; i++) {
-        if (blocks_found >= number_blocks)
-            break;
-        if (free_bm->map[i] == '0') {
-            free_bm->map[i] = '1';
-            blocks[blocks_found++] = i;
+bool unlink_fd(int inode_index) {
+    bool open = false;
+    lock_fd_table();
+    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
+        file_descriptor *fd = get_fd(i);
+        if (fd->inode == inode_index) {
+            fd->unlinked = true;
+            open = true;
         }
     }
-    sync_fbm(free_bm);
-    return blocks_found;
+    unlock_fd_table();
+    return open;
 }
 
-int find_one_unused_block(void) {
-    int block[SINGLE_BLOCK];
-    find_unused_blocks(SINGLE_BLOCK, block);
-    return block[0];
+bool inode_open(int inode_index) {
+    for (int i = 0; i < MAX_NUMBER_OF_DIRECTORY_ENTRIES; i++) {
+        if (get_fd(i)->inode == inode_index)
+            return true;
+    }
+    return false;
 }
 
-void free_used_blocks(int number_blocks, const int *blocks) {
-    for (int i = 0; i < number_blocks; ++i) {
-        int data_block = blocks[i];
-        free_bm->map[data_block] = '0';
-        clear_data_block(data_block);
+int plan_readahead(int _fd, long offset, long end, int *first) {
+    int count = 0;
+    lock_fd_table();
+    file_descriptor *fd = get_fd(_fd);
+    if (offset == fd->ra_offset) {
+        fd->ra_window = fd->ra_window == 0
+                            ? READAHEAD_MIN_BLOCKS
+                            : min(fd->ra_window * 2, READAHEAD_MAX_BLOCKS);
+        int next = (int)divide_round_up(end, BLOCK_SIZE);
+        // top the window up once the reader is half way through it, so
+        // prefetches go out in large batches. Reads as large as the window
+        // are left alone, they already reach the disk in large runs and go
+        // straight into the caller's buffer
+        bool large = end - offset >= (long)READAHEAD_MAX_BLOCKS * BLOCK_SIZE;
+        if (!large && fd->ra_end - next <= fd->ra_window / 2) {
+            *first = fd->ra_end > next ? fd->ra_end : next;
+            count = next + fd->ra_window - *first;
+            fd->ra_end = next + fd->ra_window;
+        }
+    } else {
+        fd->ra_window = 0;
+        fd->ra_end = 0;
     }
-    sync_fbm(free_bm);
+    fd->ra_offset = end;
+    unlock_fd_table();
+    return count;
 }
 
 /*
- * Creates the root directory and pre allocates 3 data blocks
+ * Returns the first free data block at or after from, -1 if there is none
  */
-void create_root_directory(void) {
-    int inode_index = create_inode();
-    if (inode_index < 0) {
-        printf("Maximum number of files has been reached\n");
-        return;
+static int next_free_block(int from) {
+    int word = from / 64;
+    int scanned = 1;
+    int skipped = 0;
+    uint64_t free_bits = ~free_bm->words[word] & (~(uint64_t)0 << (from % 64));
+    while (free_bits == 0) {
+        word++;
+        // skip full regions
+        while (word < FREE_BITMAP_WORDS && word % FREE_BITMAP_REGION_WORDS == 0 &&
+               region_free[word / FREE_BITMAP_REGION_WORDS] == 0) {
+            word += FREE_BITMAP_REGION_WORDS;
+            skipped++;
+        }
+        if (word >= FREE_BITMAP_WORDS)
+            break;
+        free_bits = ~free_bm->words[word];
+        scanned++;
     }
-    inode *root_inode = get_inode(inode_index);
-    int blocks[PRE_ALLOCATED_DIR_BLOCKS];
-    find_unused_blocks(PRE_ALLOCATED_DIR_BLOCKS, blocks);
-    for (int i = 0; i < PRE_ALLOCATED_DIR_BLOCKS; i++) {
-        root_inode->direct[i] = blocks[i];
+    COUNT(alloc_words_scanned, scanned);
+    COUNT(alloc_regions_skipped, skipped);
+    if (free_bits == 0)
+        return -1;
+    return word * 64 + __builtin_ctzll(free_bits);
+}
+
+/*
+ * Returns the number of consecutive free blocks starting at block (at most
+ * max)
+ */
+static int free_run_length(int block, int max) {
+    int length = 0;
+    while (length < max && block + length < DATA_BLOCK_SIZE) {
+        int b = block + length;
+        int bit = b % 64;
+        uint64_t used = free_bm->words[b / 64] >> bit;
+        int run = used == 0 ? 64 - bit : __builtin_ctzll(used);
+        length += run;
+        if (run < 64 - bit)
+            break;
     }
-    sync_inodes(inode_tb);
+    return min(length, max);
+}
+
+/*
+ * Allocates a run of count consecutive blocks, returns its first block or -1
+ * if the disk has no such run
+ */
+static int allocate_contiguous(int count) {
+    pthread_mutex_lock(&alloc_lock);
+    int from = 0;
+    int start = -1;
+    while (from < DATA_BLOCK_SIZE && unreserved_blocks() >= count) {
+        int block = next_free_block(from);
+        if (block < 0)
+            break;
+        int length = free_run_length(block, count);
+        if (length == count) {
+            for (int i = 0; i < count; ++i) {
+                set_block_used(block + i, true);
+            }
+            take_reserved(count);
+            start = block;
+            break;
+        }
+        from = block + length;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return start;
+}
+
+/*
+ * Allocates the first run of ready blocks (at most max) when the disk is
+ * full: they are still used in the fbm and their new file overwrites them, no
+ * scrub is needed. Returns the length of the run
+ */
+static int take_ready_blocks(extent *run, int max) {
+    int word = 0;
+    while (word < FREE_BITMAP_WORDS && reclaim_ready->words[word] == 0)
+        word++;
+    if (word == FREE_BITMAP_WORDS)
+        return 0;
+    run->start = word * 64 + __builtin_ctzll(reclaim_ready->words[word]);
+    run->length = 0;
+    while (run->length < max && run->start + run->length < DATA_BLOCK_SIZE) {
+        int block = run->start + run->length;
+        if (!((reclaim_ready->words[block / 64] >> (block % 64)) & 1))
+            break;
+        set_block_pending(block, false);
+        run->length++;
+    }
+    return run->length;
+}
+
+int allocate_extents(int goal, int number_blocks, extent *extents,
+                     int max_extents) {
+    pthread_mutex_lock(&alloc_lock);
+    COUNT(alloc_calls, 1);
+    int extent_count = 0;
+    int remaining = number_blocks;
+    int from = goal >= 0 && goal < DATA_BLOCK_SIZE ? goal : alloc_hint * 64;
+    bool wrapped = false;
+    while (remaining > 0 && extent_count < max_extents) {
+        int block = unreserved_blocks() > 0 ? next_free_block(from) : -1;
+        if (block < 0) {
+            if (!wrapped) {
+                wrapped = true;
+                from = 0;
+                continue;
+            }
+            // out of space: take the pending blocks whose free is
+            // committed, or wait for the batch the worker is releasing
+            if (reclaim_ready_count > 0) {
+                remaining -= take_ready_blocks(&extents[extent_count++],
+                                               remaining);
+                continue;
+            }
+            if (reclaim_busy_count > 0) {
+                pthread_cond_wait(&reclaim_done, &alloc_lock);
+                from = 0;
+                continue;
+            }
+            if (reclaim_pending == 0)
+                break;
+            // their frees are not committed yet
+            pthread_mutex_unlock(&alloc_lock);
+            bool committed = journal_commit_early();
+            pthread_mutex_lock(&alloc_lock);
+            if (!committed)
+                break;
+            from = 0;
+            continue;
+        }
+        int length =
+            free_run_length(block, min(remaining, unreserved_blocks()));
+        for (int i = 0; i < length; ++i) {
+            set_block_used(block + i, true);
+        }
+        take_reserved(length);
+        extents[extent_count].start = block;
+        extents[extent_count].length = length;
+        extent_count++;
+        remaining -= length;
+        from = min(block + length, DATA_BLOCK_SIZE - 1);
+    }
+    alloc_hint = from / 64;
+    pthread_mutex_unlock(&alloc_lock);
+    return extent_count;
+}
+
+int pending_blocks(void) {
+    pthread_mutex_lock(&alloc_lock);
+    int pending = reclaim_pending;
+    pthread_mutex_unlock(&alloc_lock);
+    return pending;
+}
+
+void free_used_blocks(int number_blocks, const int *blocks) {
+    // even unscrubbed blocks wait for the commit before they can be reused
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < number_blocks; ++i) {
+        set_block_pending(blocks[i], true);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    for (int i = 0; i < number_blocks; ++i) {
+        forget_data_blocks(blocks[i], SINGLE_BLOCK);
+    }
+    flush_fbm();
 }
@@ -6,19 +6,12 @@
 
 extern inode_table *inode_tb;
 
-extern free_byte_map *free_bm;
-
-extern directory *root_directory;
+extern free_bitmap *free_bm;
 
 extern file_descriptor_table *fd_table;
 
 void clear_array(int *, int);
 
-/*
- * gets a dir entry by index
- */
-directory_entry *get_dir_entry(int);
-
 /*
  * returns the file_descriptor at the given location
  */
@@ -35,90 +28,204 @@ inode *get_inode(int);
 inode *get_root_inode(void);
 
 /*
- * Clears the root directory (sets every inode to -1 and sets every name to
- * '\0')
+ * Returns the index of an inode in the inode table
+ */
+int get_inode_index(inode *);
+
+/*
+ * Per inode reader/writer lock (fields, data and index block). Take the
+ * directory lock first when both are needed
+ */
+void lock_inode(int, bool);
+
+void unlock_inode(int);
+
+/*
+ * Root directory reader/writer lock (its blocks and the root inode)
+ */
+void lock_dir(bool);
+
+void unlock_dir(void);
+
+/*
+ * fd table lock (open fds and fd pointers)
  */
-void clear_root_dir(void);
+void lock_fd_table(void);
+
+void unlock_fd_table(void);
+
+/*
+ * Marks the inode table block holding the inode as dirty and takes a copy of
+ * the inode for the next flush. Called after every change of an inode, with
+ * its lock held
+ */
+void mark_inode_dirty(int);
 
 /*
- * Init the inode table
+ * Syncs only the dirty inode table blocks into the disk
+ */
+void flush_inodes(void);
+
+/*
+ * Init the inode table, the table of a disk made before version 4 is
+ * converted to the current inodes and moved into the data blocks
  */
 void init_inode_table(void);
 
 /*
- * Init the fbm into the disk
+ * Init the fbm into the disk, converts a version 0 free byte map into the
+ * bitmap when an old disk is mounted
  */
 void init_fbm(bool);
 
+/*
+ * Syncs only the dirty fbm and reclaim map blocks into the disk
+ */
+void flush_fbm(void);
+
+/*
+ * Starts the background worker that scrubs freed blocks and releases them in
+ * the fbm (blocks left pending by the last mount are resumed)
+ */
+void start_reclaim(void);
+
+/*
+ * Stops the reclaim worker, blocks still pending stay in the reclaim map
+ */
+void stop_reclaim(void);
+
 /*
  * Init FD table
  */
 void init_fd_table(void);
 
 /*
- * Init root dir cache
+ * Creates an inode at an unused slot (taken from the free inode list, no
+ * scan of the table) and marks it dirty, does not sync to the disk
  */
-void init_root_dir_cache(void);
+int create_inode(void);
 
 /*
- * Finds a dir entry with given name and returns the index, returns -1 if not
- * found
+ * Frees the blocks of an inode and puts it back on the free inode list
  */
-directory_entry *find_dir_entry(const char *);
+int delete_inode(int);
 
 /*
- * Loads the root directory from the disk into memory
+ * Looks up the data blocks of file blocks [first, first + count) into the
+ * buf, a block that is not mapped (a hole) reads as -1
  */
-void load_root_dir(void);
+void map_file_blocks(inode *node, int first, int count, int *buf);
 
 /*
- * Syncs the root directory from memory into the disk
+ * Maps file blocks [first, first + count) to the data blocks in the buf
+ * (entries < 0 are skipped), allocating the index blocks on the way. Returns
+ * -1 if the disk is full, the blocks mapped until then stay mapped
  */
-void sync_root_dir(void);
+int set_file_blocks(inode *node, int first, int count, const int *buf);
 
 /*
- * Creates an inode at an unused slot, does not sync to the disk
+ * Frees every data block of the file from file block first on, and the index
+ * blocks left with nothing to map. The pointers are persisted before the
+ * blocks can be reused
  */
-int create_inode(void);
-
-int delete_inode(int);
+void free_file_blocks(inode *node, int first);
 
 /*
- * copies the data block numbers from the inode into the buf, returns the number
- * of data blocks used (assumes the size of buf is 268)
+ * Large frees go in steps from the end of the file, each one its own
+ * journal operation. Returns the file block where the step freeing the file
+ * from file block first on starts: at most count file blocks below the end of
+ * its last mapped block, first for the last step
  */
-int get_inode_data_blocks(inode *node, int *buf);
+int free_step_start(inode *, int, int);
 
 /*
- * updates the inode with the blocks used by the file
+ * Journal credits (blocks it may log) of mapping count consecutive file
+ * blocks, and of freeing them (a directory's blocks are revoked too)
  */
-void update_inode_data_blocks(inode *node, const int *buf);
+int map_credits(int);
+
+int free_credits(int, bool);
 
 /*
- * Adds an entry to the fd_table
+ * Adds an entry to the fd_table, every open of a file gets its own fd
  * Returns the fd for this file (index on in the fd_table)
  * Returns -1 if fd_table is full
  */
-int add_fd(int, int);
+int add_fd(int, long);
+
+/*
+ * Marks the fds of an inode as unlinked, the inode is freed at their last
+ * close. Returns false if the inode is not open
+ */
+bool unlink_fd(int);
+
+/*
+ * Returns true if an fd of the inode is open (fd table lock held)
+ */
+bool inode_open(int);
+
+/*
+ * Per-inode write buffers, the caller holds the inode lock (exclusively to
+ * attach or release one). Returns the buffer of an inode, NULL if it has none
+ */
+write_buffer *get_write_buffer(int);
+
+/*
+ * Gives an inode a write buffer from the pool and reserves the free blocks
+ * its flush may need. NULL when no buffer or not enough free blocks are left
+ */
+write_buffer *attach_write_buffer(int);
+
+/*
+ * Returns the write buffer of an inode to the pool with what is left of its
+ * reservation, its data is dropped
+ */
+void release_write_buffer(int);
+
+/*
+ * Brackets the flush of the write buffer of an inode: the allocations of the
+ * calling thread take the blocks the buffer reserved. A written buffer gives
+ * back what it did not take, one that could not be written keeps its whole
+ * reservation for the next try
+ */
+void begin_buffer_flush(int);
+
+void end_buffer_flush(int, bool);
+
+/*
+ * Fills the array (WRITE_BUFFER_COUNT entries, one per buffer of the pool)
+ * with the inodes that hold a write buffer and returns how many there are
+ */
+int buffered_inodes(int *);
+
+void init_write_buffers(void);
 
 /*
- * Finds free data blocks using fbm, updates the fbm
+ * Records a read of [offset, end) on an fd and returns how many file blocks
+ * to prefetch from *first: the window grows while the reads are sequential,
+ * a random read closes it
  */
-int find_unused_blocks(int, int *);
+int plan_readahead(int, long, long, int *);
 
 /*
- * find one unused block
+ * Allocates data blocks as extents of consecutive blocks using the fbm,
+ * starting at the goal block (or at the allocation hint when goal < 0).
+ * Fills at most max_extents extents and returns how many were used.
+ * Only updates the fbm in memory, flush_fbm persists it
  */
-int find_one_unused_block(void);
+int allocate_extents(int goal, int number_blocks, extent *extents,
+                     int max_extents);
 
 /*
- * Frees data blocks and updates fbm
+ * Frees data blocks: they are put on the reclaim map and released in the fbm
+ * by the reclaim worker once scrubbed
  */
 void free_used_blocks(int, const int *);
 
 /*
- * Creates the root directory and pre allocates 3 data blocks
+ * Returns the number of freed blocks not released yet, an allocation can only
+ * take them once their free is committed
  */
-void create_root_directory(void);
+int pending_blocks(void);
 
 #endif
@@ -0,0 +1,679 @@
+#include "sfs_dir.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_SLOTS MAX_NUMBER_DIR_ENTRIES_PER_BLOCK
+
+/*
+ * The index blocks from the root down to the leaf of a hash
+ */
+typedef struct {
+    dx_block *nodes[DX_MAX_LEVELS];
+    int blocks[DX_MAX_LEVELS];    // file block of each index block
+    int positions[DX_MAX_LEVELS]; // entry followed in each
+    int depth;                    // index blocks on the path
+    int leaf;                     // file block of the leaf
+} dx_path;
+
+/*
+ * Dentry cache, the result of (directory, name) lookups: the inode, or -1 for
+ * a name that is not there. A hash table of chained entries, also kept on an
+ * LRU list (most recent first) whose tail is reused when a new name comes in
+ */
+typedef struct dentry {
+    int dir; // -1 for an unused entry
+    int inode;
+    uint32_t hash;
+    char name[MAX_FILE_NAME_SIZE];
+    struct dentry *chain;
+    struct dentry *newer;
+    struct dentry *older;
+} dentry;
+
+static dentry *dentries;
+
+static dentry **dentry_buckets;
+
+static dentry *lru_newest;
+
+static dentry *lru_oldest;
+
+static pthread_mutex_t dentry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define DENTRY_BUCKETS (DENTRY_CACHE_SIZE * 2)
+
+/*
+ * Names are compared on at most MAX_FILE_NAME_SIZE - 1 characters, the size
+ * stored in a dir entry
+ */
+static int dir_name_length(const char *name) {
+    return (int)strnlen(name, MAX_FILE_NAME_SIZE - 1);
+}
+
+/*
+ * FNV-1a. The hashes are stored in the index blocks, it must not change
+ */
+static uint32_t hash_name(const char *name, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t entry_hash(const directory_entry *entry) {
+    return hash_name(entry->name, dir_name_length(entry->name));
+}
+
+static uint32_t dentry_hash(int dir, uint32_t name_hash) {
+    return name_hash ^ ((uint32_t)dir * 2654435761u);
+}
+
+static dentry **dentry_bucket(uint32_t hash) {
+    return &dentry_buckets[hash % DENTRY_BUCKETS];
+}
+
+static void lru_unlink(dentry *entry) {
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        lru_newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        lru_oldest = entry->newer;
+}
+
+static void lru_push(dentry *entry) {
+    entry->newer = NULL;
+    entry->older = lru_newest;
+    if (lru_newest != NULL)
+        lru_newest->newer = entry;
+    lru_newest = entry;
+    if (lru_oldest == NULL)
+        lru_oldest = entry;
+}
+
+/*
+ * Returns the entry of the name in the directory, NULL if it is not cached.
+ * Called with the dentry lock held
+ */
+static dentry *find_dentry(int dir, const char *name, int length,
+                           uint32_t hash) {
+    for (dentry *entry = *dentry_bucket(hash); entry != NULL;
+         entry = entry->chain) {
+        if (entry->hash == hash && entry->dir == dir &&
+            strncmp(entry->name, name, length) == 0 &&
+            entry->name[length] == '\0')
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Records the inode of a name (-1 when it is missing), over the least
+ * recently used entry if the name is new
+ */
+static void set_dentry(int dir, const char *name, int length,
+                       uint32_t name_hash, int inode_index) {
+    uint32_t hash = dentry_hash(dir, name_hash);
+    pthread_mutex_lock(&dentry_lock);
+    dentry *entry = find_dentry(dir, name, length, hash);
+    if (entry == NULL) {
+        entry = lru_oldest;
+        if (entry->dir >= 0) {
+            dentry **link = dentry_bucket(entry->hash);
+            while (*link != entry) {
+                link = &(*link)->chain;
+            }
+            *link = entry->chain;
+        }
+        entry->dir = dir;
+        entry->hash = hash;
+        memset(entry->name, 0, MAX_FILE_NAME_SIZE);
+        memcpy(entry->name, name, length);
+        entry->chain = *dentry_bucket(hash);
+        *dentry_bucket(hash) = entry;
+    }
+    entry->inode = inode_index;
+    lru_unlink(entry);
+    lru_push(entry);
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+/*
+ * Looks the name up in the dentry cache, returns false if it is not cached
+ */
+static bool get_dentry(int dir, const char *name, int length,
+                       uint32_t name_hash, int *inode_index) {
+    uint32_t hash = dentry_hash(dir, name_hash);
+    pthread_mutex_lock(&dentry_lock);
+    dentry *entry = find_dentry(dir, name, length, hash);
+    if (entry != NULL) {
+        *inode_index = entry->inode;
+        lru_unlink(entry);
+        lru_push(entry);
+    }
+    pthread_mutex_unlock(&dentry_lock);
+    return entry != NULL;
+}
+
+static bool dir_entry_matches(directory_entry *entry, const char *name,
+                              int length) {
+    return entry->inode > 0 && strncmp(entry->name, name, length) == 0 &&
+           entry->name[length] == '\0';
+}
+
+/*
+ * Directory blocks are addressed by file block, so the index does not depend
+ * on where they are on the disk
+ */
+static void read_dir_block(inode *dir, int file_block, void *buf) {
+    int block;
+    map_file_blocks(dir, file_block, 1, &block);
+    if (block < 0) {
+        clear_buffer(buf, BLOCK_SIZE);
+        return;
+    }
+    load_dir_block(block, buf, BLOCK_SIZE);
+}
+
+static void write_dir_block(inode *dir, int file_block, void *buf) {
+    int block;
+    map_file_blocks(dir, file_block, 1, &block);
+    if (block < 0)
+        return;
+    COUNT(dir_block_syncs, 1);
+    sync_dir_block(block, buf, BLOCK_SIZE);
+}
+
+static void init_index_block(dx_block *node) {
+    clear_buffer((char *)node, BLOCK_SIZE);
+    memcpy(node->header.name, DX_MARKER, sizeof(DX_MARKER));
+}
+
+/*
+ * Appends a block to the directory file, next to its last block when that one
+ * is free. Returns the file block or -1 if the disk is full
+ */
+static int grow_dir(int dir_index) {
+    inode *dir = get_inode(dir_index);
+    int file_block = (int)(dir->size / BLOCK_SIZE);
+    int goal = -1;
+    if (file_block > 0) {
+        map_file_blocks(dir, file_block - 1, 1, &goal);
+        if (goal >= 0)
+            goal++;
+    }
+    extent run;
+    if (allocate_extents(goal, 1, &run, 1) < 1)
+        return -1;
+    if (set_file_blocks(dir, file_block, 1, &run.start) < 0) {
+        free_used_blocks(1, &run.start);
+        return -1;
+    }
+    dir->size += BLOCK_SIZE;
+    mark_inode_dirty(dir_index);
+    flush_inodes();
+    return file_block;
+}
+
+static void open_path(dx_path *path) {
+    for (int i = 0; i < DX_MAX_LEVELS; i++) {
+        path->nodes[i] = malloc(BLOCK_SIZE);
+    }
+}
+
+static void close_path(dx_path *path) {
+    for (int i = 0; i < DX_MAX_LEVELS; i++) {
+        free(path->nodes[i]);
+    }
+}
+
+/*
+ * Returns the last entry of an index block with a hash <= the hash, the first
+ * entry covers every hash below the second one
+ */
+static int find_dx_entry(const dx_block *node, uint32_t hash) {
+    int low = 1;
+    int high = node->count - 1;
+    int found = 0;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (node->entries[middle].hash <= hash) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+static void walk_path(inode *dir, uint32_t hash, dx_path *path) {
+    read_dir_block(dir, 0, path->nodes[0]);
+    path->blocks[0] = 0;
+    path->depth = path->nodes[0]->levels + 1;
+    if (path->depth > DX_MAX_LEVELS)
+        path->depth = DX_MAX_LEVELS;
+    for (int level = 0; level < path->depth; level++) {
+        dx_block *node = path->nodes[level];
+        int position = find_dx_entry(node, hash);
+        path->positions[level] = position;
+        int next = node->entries[position].block;
+        if (level + 1 < path->depth) {
+            path->blocks[level + 1] = next;
+            read_dir_block(dir, next, path->nodes[level + 1]);
+        } else {
+            path->leaf = next;
+        }
+    }
+}
+
+static void insert_dx_entry(dx_block *node, int position, uint32_t hash,
+                            int block) {
+    memmove(&node->entries[position + 1], &node->entries[position],
+            sizeof(dx_entry) * (node->count - position));
+    node->entries[position].hash = hash;
+    node->entries[position].block = block;
+    node->count++;
+}
+
+static int compare_hash(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Moves the upper half (by hash) of a full leaf into a new leaf and indexes
+ * it in the parent, which must have room. Names with the same hash stay
+ * together, returns -1 if they fill the leaf or the disk is full
+ */
+static int split_leaf(int dir_index, dx_path *path, directory_entry *leaf) {
+    inode *dir = get_inode(dir_index);
+    uint32_t *hashes = malloc(sizeof(uint32_t) * DIR_SLOTS);
+    for (int i = 0; i < DIR_SLOTS; i++) {
+        hashes[i] = entry_hash(&leaf[i]);
+    }
+    qsort(hashes, DIR_SLOTS, sizeof(uint32_t), compare_hash);
+
+    // the hash boundary closest to the middle
+    int middle = DIR_SLOTS / 2;
+    int split = -1;
+    for (int distance = 0; distance <= middle && split < 0; distance++) {
+        int above = middle + distance;
+        int below = middle - distance;
+        if (above < DIR_SLOTS && hashes[above] != hashes[above - 1])
+            split = above;
+        else if (below > 0 && hashes[below] != hashes[below - 1])
+            split = below;
+    }
+    uint32_t split_hash = split < 0 ? 0 : hashes[split];
+    free(hashes);
+    if (split < 0)
+        return -1;
+    int new_leaf = grow_dir(dir_index);
+    if (new_leaf < 0)
+        return -1;
+
+    directory_entry *upper = calloc(1, BLOCK_SIZE);
+    int moved = 0;
+    for (int i = 0; i < DIR_SLOTS; i++) {
+        if (entry_hash(&leaf[i]) >= split_hash) {
+            upper[moved++] = leaf[i];
+            memset(&leaf[i], 0, sizeof(directory_entry));
+        }
+    }
+    write_dir_block(dir, new_leaf, upper);
+    write_dir_block(dir, path->leaf, leaf);
+    free(upper);
+
+    int parent = path->depth - 1;
+    insert_dx_entry(path->nodes[parent], path->positions[parent] + 1,
+                    split_hash, new_leaf);
+    write_dir_block(dir, path->blocks[parent], path->nodes[parent]);
+    return 0;
+}
+
+/*
+ * Makes room in the full index block at a level of the path. The root moves
+ * its entries into a new child and gains a level, another block moves its
+ * upper half into a new sibling (splitting its parent first when that one is
+ * full). The path is stale afterwards. Returns -1 if the tree is at its
+ * maximum depth or the disk is full
+ */
+static int split_index(int dir_index, dx_path *path, int level) {
+    inode *dir = get_inode(dir_index);
+    dx_block *node = path->nodes[level];
+    if (level > 0 && path->nodes[level - 1]->count >= DX_ENTRIES_PER_BLOCK)
+        return split_index(dir_index, path, level - 1);
+    if (level == 0 && path->depth >= DX_MAX_LEVELS)
+        return -1;
+    int new_node = grow_dir(dir_index);
+    if (new_node < 0)
+        return -1;
+
+    dx_block *moved = malloc(BLOCK_SIZE);
+    init_index_block(moved);
+    int keep = level == 0 ? 0 : node->count / 2;
+    moved->count = node->count - keep;
+    memcpy(moved->entries, &node->entries[keep],
+           sizeof(dx_entry) * moved->count);
+    write_dir_block(dir, new_node, moved);
+
+    if (level == 0) {
+        node->levels++;
+        node->count = 1;
+        node->entries[0].hash = 0;
+        node->entries[0].block = new_node;
+        write_dir_block(dir, 0, node);
+    } else {
+        node->count = keep;
+        write_dir_block(dir, path->blocks[level], node);
+        dx_block *parent = path->nodes[level - 1];
+        insert_dx_entry(parent, path->positions[level - 1] + 1,
+                        moved->entries[0].hash, new_node);
+        write_dir_block(dir, path->blocks[level - 1], parent);
+    }
+    free(moved);
+    return 0;
+}
+
+int dir_create(int dir_index) {
+    inode *dir = get_inode(dir_index);
+    if (grow_dir(dir_index) != 0 || grow_dir(dir_index) != 1)
+        return -1;
+    dx_block *root = malloc(BLOCK_SIZE);
+    init_index_block(root);
+    root->levels = 0;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    write_dir_block(dir, 0, root);
+    clear_buffer((char *)root, BLOCK_SIZE);
+    write_dir_block(dir, 1, root);
+    free(root);
+    return 0;
+}
+
+void init_dentry_cache(void) {
+    pthread_mutex_lock(&dentry_lock);
+    if (dentries == NULL) {
+        dentries = malloc(sizeof(dentry) * DENTRY_CACHE_SIZE);
+        dentry_buckets = malloc(sizeof(dentry *) * DENTRY_BUCKETS);
+    }
+    for (int i = 0; i < DENTRY_BUCKETS; i++) {
+        dentry_buckets[i] = NULL;
+    }
+    lru_newest = NULL;
+    lru_oldest = NULL;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dentries[i].dir = -1;
+        lru_push(&dentries[i]);
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+int dir_lookup(int dir_index, const char *name) {
+    inode *dir = get_inode(dir_index);
+    int length = dir_name_length(name);
+    uint32_t hash = hash_name(name, length);
+    COUNT(dir_lookups, 1);
+    int cached;
+    if (get_dentry(dir_index, name, length, hash, &cached)) {
+        COUNT(dcache_hits, 1);
+        if (cached < 0)
+            COUNT(dcache_negative_hits, 1);
+        return cached;
+    }
+
+    dx_path path;
+    open_path(&path);
+    walk_path(dir, hash, &path);
+    directory_entry *leaf = (directory_entry *)path.nodes[0];
+    read_dir_block(dir, path.leaf, leaf);
+    int found = -1;
+    for (int i = 0; i < DIR_SLOTS; i++) {
+        if (dir_entry_matches(&leaf[i], name, length)) {
+            found = leaf[i].inode;
+            break;
+        }
+    }
+    COUNT(dir_probes, path.depth + 1);
+    close_path(&path);
+    // under the shared directory lock, no entry changes meanwhile
+    set_dentry(dir_index, name, length, hash, found);
+    return found;
+}
+
+int dir_add(int dir_index, const char *name, int inode_index) {
+    inode *dir = get_inode(dir_index);
+    int length = dir_name_length(name);
+    uint32_t hash = hash_name(name, length);
+    directory_entry *leaf = malloc(BLOCK_SIZE);
+    dx_path path;
+    open_path(&path);
+    int status = -1;
+    // every retry splits a block, at most one per level and the leaf
+    for (int attempt = 0; attempt <= 2 * DX_MAX_LEVELS; attempt++) {
+        walk_path(dir, hash, &path);
+        read_dir_block(dir, path.leaf, leaf);
+        int slot = -1;
+        for (int i = 0; i < DIR_SLOTS && slot < 0; i++) {
+            if (leaf[i].inode <= 0)
+                slot = i;
+        }
+        if (slot >= 0) {
+            memset(&leaf[slot], 0, sizeof(directory_entry));
+            memcpy(leaf[slot].name, name, length);
+            leaf[slot].inode = inode_index;
+            write_dir_block(dir, path.leaf, leaf);
+            set_dentry(dir_index, name, length, hash, inode_index);
+            status = 0;
+            break;
+        }
+        int parent = path.depth - 1;
+        int split = path.nodes[parent]->count < DX_ENTRIES_PER_BLOCK
+                        ? split_leaf(dir_index, &path, leaf)
+                        : split_index(dir_index, &path, parent);
+        if (split < 0)
+            break;
+    }
+    close_path(&path);
+    free(leaf);
+    return status;
+}
+
+int dir_add_credits(void) {
+    // every split grows the directory by a block and writes at most 3 blocks
+    int splits = 2 * DX_MAX_LEVELS;
+    return DX_MAX_LEVELS + 1 + 2 * splits + map_credits(splits);
+}
+
+int dir_remove(int dir_index, const char *name) {
+    inode *dir = get_inode(dir_index);
+    int length = dir_name_length(name);
+    uint32_t hash = hash_name(name, length);
+    dx_path path;
+    open_path(&path);
+    walk_path(dir, hash, &path);
+    directory_entry *leaf = (directory_entry *)path.nodes[0];
+    read_dir_block(dir, path.leaf, leaf);
+    int found = -1;
+    for (int i = 0; i < DIR_SLOTS; i++) {
+        if (dir_entry_matches(&leaf[i], name, length)) {
+            found = leaf[i].inode;
+            // leaves are never merged, the slot is reused by the next insert
+            memset(&leaf[i], 0, sizeof(directory_entry));
+            write_dir_block(dir, path.leaf, leaf);
+            break;
+        }
+    }
+    close_path(&path);
+    set_dentry(dir_index, name, length, hash, -1);
+    return found;
+}
+
+/*
+ * A listing goes in hash order and its position is a hash, the names with
+ * that hash (all in one leaf) told apart by their rank in name order. A split
+ * moves entries to another leaf, not to another position
+ */
+#define DIR_RANK_BITS 31
+
+typedef struct {
+    uint32_t hash;
+    directory_entry *entry;
+} hashed_entry;
+
+static int compare_hashed(const void *a, const void *b) {
+    const hashed_entry *x = a;
+    const hashed_entry *y = b;
+    if (x->hash != y->hash)
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    return strncmp(x->entry->name, y->entry->name, MAX_FILE_NAME_SIZE - 1);
+}
+
+/*
+ * Sets end to the first hash past the leaf of the path, returns false for
+ * the last leaf
+ */
+static bool leaf_end(const dx_path *path, uint32_t *end) {
+    for (int level = path->depth - 1; level >= 0; level--) {
+        const dx_block *node = path->nodes[level];
+        if (path->positions[level] + 1 < node->count) {
+            *end = node->entries[path->positions[level] + 1].hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+int dir_read(int dir_index, long position, directory_entry *entries,
+             long *next, int max) {
+    inode *dir = get_inode(dir_index);
+    uint32_t hash = (uint32_t)(position >> DIR_RANK_BITS);
+    int skip = (int)(position & ((1L << DIR_RANK_BITS) - 1));
+    directory_entry *leaf = malloc(BLOCK_SIZE);
+    hashed_entry *sorted = malloc(sizeof(hashed_entry) * DIR_SLOTS);
+    dx_path path;
+    open_path(&path);
+    int count = 0;
+    bool more = true;
+    while (more && count < max) {
+        walk_path(dir, hash, &path);
+        read_dir_block(dir, path.leaf, leaf);
+        int used = 0;
+        for (int i = 0; i < DIR_SLOTS; i++) {
+            if (leaf[i].inode > 0) {
+                sorted[used].hash = entry_hash(&leaf[i]);
+                sorted[used++].entry = &leaf[i];
+            }
+        }
+        qsort(sorted, used, sizeof(hashed_entry), compare_hashed);
+        int rank = 0;
+        for (int i = 0; i < used && count < max; i++) {
+            rank = i > 0 && sorted[i].hash == sorted[i - 1].hash ? rank + 1 : 0;
+            if (sorted[i].hash < hash || (sorted[i].hash == hash && rank < skip))
+                continue;
+            entries[count] = *sorted[i].entry;
+            next[count++] = (long)sorted[i].hash << DIR_RANK_BITS | (rank + 1);
+        }
+        more = leaf_end(&path, &hash);
+        skip = 0;
+    }
+    close_path(&path);
+    free(sorted);
+    free(leaf);
+    return count;
+}
+
+void create_root_directory(void) {
+    int inode_index = create_inode();
+    if (inode_index < 0) {
+        printf("Maximum number of files has been reached\n");
+        return;
+    }
+    get_inode(inode_index)->mode = INODE_MODE_DIR;
+    mark_inode_dirty(inode_index);
+    if (dir_create(inode_index) < 0)
+        printf("No space left for the root directory\n");
+}
+
+/*
+ * Returns the entries of the flat directory of a disk before version 5, its
+ * blocks are freed and the root gets an empty tree
+ */
+static directory_entry *take_flat_entries(int *count) {
+    inode *root = get_root_inode();
+    directory_entry *buf = malloc(BLOCK_SIZE);
+    directory_entry *entries =
+        malloc(sizeof(directory_entry) * FLAT_DIR_BLOCKS * DIR_SLOTS);
+    *count = 0;
+    for (int i = 0; i < FLAT_DIR_BLOCKS; i++) {
+        read_dir_block(root, i, buf);
+        for (int slot = 0; slot < DIR_SLOTS; slot++) {
+            if (buf[slot].inode > 0)
+                entries[(*count)++] = buf[slot];
+        }
+    }
+    free(buf);
+    free_file_blocks(root, 0);
+    root->size = 0;
+    mark_inode_dirty(ROOT_INODE);
+    if (dir_create(ROOT_INODE) < 0)
+        printf("No space left for the root directory\n");
+    return entries;
+}
+
+/*
+ * Returns the entries of the root tree whose name starts with '/' and
+ * removes them
+ */
+static directory_entry *take_path_entries(int *count) {
+    int capacity = 16;
+    directory_entry *entries = malloc(sizeof(directory_entry) * capacity);
+    directory_entry entry;
+    long position = 0;
+    *count = 0;
+    while (dir_read(ROOT_INODE, position, &entry, &position, 1) > 0) {
+        if (entry.name[0] != '/')
+            continue;
+        if (*count == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, sizeof(directory_entry) * capacity);
+        }
+        entries[(*count)++] = entry;
+    }
+    for (int i = 0; i < *count; i++) {
+        dir_remove(ROOT_INODE, entries[i].name);
+    }
+    return entries;
+}
+
+void load_root_dir(int version) {
+    if (version >= SFS_VERSION_TREE)
+        return;
+    // before subdirectories, names were stored as given, FUSE gave "/name"
+    int count;
+    directory_entry *entries = version < SFS_VERSION_HTREE
+                                   ? take_flat_entries(&count)
+                                   : take_path_entries(&count);
+    for (int i = 0; i < count; i++) {
+        char *name = entries[i].name;
+        name[MAX_FILE_NAME_SIZE - 1] = '\0';
+        while (*name == '/')
+            name++;
+        // the old name is kept if the new one is taken
+        if (*name == '\0' || dir_lookup(ROOT_INODE, name) >= 0)
+            name = entries[i].name;
+        dir_add(ROOT_INODE, name, entries[i].inode);
+    }
+    free(entries);
+    get_root_inode()->mode = INODE_MODE_DIR;
+    mark_inode_dirty(ROOT_INODE);
+    flush_inodes();
+}
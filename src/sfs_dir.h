@@ -0,0 +1,74 @@
+#ifndef SFS_DIR_H
+#define SFS_DIR_H
+
+#include "sfs_cache.h"
+
+/*
+ * Directories are files of directory blocks indexed by a hash tree. File
+ * block 0 is the index root: it maps ranges of name hashes to leaf blocks,
+ * through at most DX_MAX_LEVELS - 1 levels of index blocks. A leaf is an
+ * array of directory entries, a free slot has inode 0. A lookup reads one
+ * block per level, an insert or a remove writes the leaf it changes. A full
+ * leaf is split in two by hash. Only the blocks on the way are in memory
+ *
+ * Lookups go through a dentry cache of (directory, name) pairs, names found
+ * missing included, bounded to DENTRY_CACHE_SIZE entries (LRU). Inserts and
+ * removes keep it up to date
+ *
+ * The caller holds the directory lock, exclusively to change a directory
+ */
+
+/*
+ * Empties the dentry cache, at mount
+ */
+void init_dentry_cache(void);
+
+/*
+ * Makes the inode an empty directory (the index root and one leaf), returns
+ * -1 if the disk is full
+ */
+int dir_create(int);
+
+/*
+ * Returns the inode of the name in the directory, -1 if it is not there
+ */
+int dir_lookup(int, const char *);
+
+/*
+ * Adds an entry for the name, returns -1 if the disk or the hash range of the
+ * name is full
+ */
+int dir_add(int, const char *, int);
+
+/*
+ * Journal credits of an insert, splits included (a remove writes one block)
+ */
+int dir_add_credits(void);
+
+/*
+ * Removes the entry of the name, returns its inode or -1 if it is not there
+ */
+int dir_remove(int, const char *);
+
+/*
+ * Copies up to max entries found at or after the position (0 for the first
+ * one) and the position after each of them. Entries come in hash order and a
+ * position is a hash, so it stays valid across calls: an entry there all
+ * along shows up once, leaf splits meanwhile or not. Returns how many were
+ * copied, 0 when no entry is left
+ */
+int dir_read(int, long, directory_entry *, long *, int);
+
+/*
+ * Creates the root inode and its empty directory
+ */
+void create_root_directory(void);
+
+/*
+ * Opens the root directory of a disk made with the given format version. The
+ * flat directory of a disk before version 5 is moved into a hash tree, and
+ * the names stored as FUSE paths ("/name") before version 6 lose their '/'
+ */
+void load_root_dir(int);
+
+#endif
@@ -1,15 +1,17 @@
 #include "sfs_disk.h"
 #include "disk_emu.h"
+#include "sfs_buffer.h"
+#include "sfs_journal.h"
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-void clear_buffer(char *buf, int size) {
-    for (int i = 0; i < size; ++i) {
-        buf[i] = 0;
-    }
-}
+fs_geometry geometry;
+
+void clear_buffer(char *buf, int size) { memset(buf, 0, size); }
 
-int divide_round_up(int a1, int a2) { return (a1 + a2 - 1) / a2; }
+long divide_round_up(long a1, long a2) { return (a1 + a2 - 1) / a2; }
 
 int min(int a1, int a2) {
     if (a1 < a2)
@@ -17,53 +19,322 @@ int min(int a1, int a2) {
     return a2;
 }
 
+long min_long(long a1, long a2) {
+    if (a1 < a2)
+        return a1;
+    return a2;
+}
+
+/*
+ * Blocks a file reaches through its direct pointers and its 3 indirect trees,
+ * capped so file block numbers fit in an int
+ */
+static int max_file_blocks(int block_size) {
+    long pointers = block_size / 4;
+    long blocks = INODE_DIRECT_BLOCK_COUNT + pointers + pointers * pointers +
+                  pointers * pointers * pointers;
+    return blocks > INT_MAX ? INT_MAX : (int)blocks;
+}
+
+/*
+ * Lays out a fresh disk: super block, inode table, data blocks, free bitmap,
+ * reclaim map and journal. Returns -1 if the parameters are out of range
+ */
+static int format_geometry(int block_size, int inode_count, int data_blocks) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0 || inode_count < 2 ||
+        data_blocks < 2)
+        return -1;
+    long table_size =
+        divide_round_up((long)inode_count * sizeof(inode), block_size);
+    long bitmap_size =
+        divide_round_up(divide_round_up(data_blocks, 64), block_size / 8);
+    long num_blocks = SUPER_BLOCK_SIZE + table_size + (long)data_blocks +
+                      2 * bitmap_size + JOURNAL_BLOCKS;
+    if (num_blocks > INT_MAX)
+        return -1;
+
+    geometry.block_size = block_size;
+    geometry.num_blocks = (int)num_blocks;
+    geometry.inode_count = inode_count;
+    geometry.inode_table_address = SUPER_BLOCK_ADDRESS + SUPER_BLOCK_SIZE;
+    geometry.inode_table_size = (int)table_size;
+    geometry.data_block_address =
+        geometry.inode_table_address + geometry.inode_table_size;
+    geometry.data_block_count = data_blocks;
+    geometry.free_bitmap_address = geometry.data_block_address + data_blocks;
+    geometry.bitmap_size = (int)bitmap_size;
+    geometry.reclaim_map_address =
+        geometry.free_bitmap_address + geometry.bitmap_size;
+    geometry.journal_address =
+        geometry.reclaim_map_address + geometry.bitmap_size;
+    geometry.journal_size = JOURNAL_BLOCKS;
+    geometry.max_file_blocks = max_file_blocks(block_size);
+    return 0;
+}
+
+/*
+ * Disks made before version 4 have the fixed layout. Their inode table holds
+ * 64 byte inodes until init_inode_table moves it into the data blocks
+ */
+static void legacy_geometry(void) {
+    geometry.block_size = LEGACY_BLOCK_SIZE;
+    geometry.num_blocks = LEGACY_MAX_BLOCK;
+    geometry.inode_count = LEGACY_INODE_COUNT;
+    geometry.inode_table_address = LEGACY_INODE_TABLE_ADDRESS;
+    geometry.inode_table_size = LEGACY_INODE_TABLE_SIZE;
+    geometry.data_block_address = LEGACY_DATA_BLOCK_ADDRESS;
+    geometry.data_block_count = LEGACY_DATA_BLOCK_SIZE;
+    geometry.free_bitmap_address = FREE_BYTE_MAP_ADDRESS;
+    geometry.bitmap_size = (int)divide_round_up(
+        divide_round_up(LEGACY_DATA_BLOCK_SIZE, 64), LEGACY_BLOCK_SIZE / 8);
+    geometry.reclaim_map_address =
+        geometry.free_bitmap_address + geometry.bitmap_size;
+    geometry.journal_address = LEGACY_JOURNAL_ADDRESS;
+    geometry.journal_size = JOURNAL_BLOCKS;
+    geometry.max_file_blocks = max_file_blocks(LEGACY_BLOCK_SIZE);
+}
+
+static void set_geometry(const super_block *block) {
+    if (block->version < SFS_VERSION_GEOMETRY) {
+        legacy_geometry();
+        return;
+    }
+    geometry.block_size = block->block_size;
+    geometry.num_blocks = block->num_blocks;
+    geometry.inode_count = block->inode_count;
+    geometry.inode_table_address = block->inode_table_address;
+    geometry.inode_table_size = block->num_inode_blocks;
+    geometry.data_block_address = block->data_block_address;
+    geometry.data_block_count = block->data_block_count;
+    geometry.free_bitmap_address = block->free_bitmap_address;
+    geometry.bitmap_size = block->bitmap_size;
+    geometry.reclaim_map_address = block->reclaim_map_address;
+    geometry.journal_address = block->journal_address;
+    geometry.journal_size = block->journal_size;
+    geometry.max_file_blocks = max_file_blocks(block->block_size);
+}
+
+/*
+ * The block size of an existing disk is only known once its super block is
+ * read, the disk is opened with the smallest one to read it
+ */
+static void read_geometry(void) {
+    char buffer[MIN_BLOCK_SIZE];
+    super_block block;
+    clear_buffer(buffer, MIN_BLOCK_SIZE);
+    if (init_disk(DISK_NAME, MIN_BLOCK_SIZE, SUPER_BLOCK_SIZE) == 0) {
+        read_blocks(SUPER_BLOCK_ADDRESS, SUPER_BLOCK_SIZE, buffer);
+        close_disk();
+    }
+    memcpy(&block, buffer, sizeof(super_block));
+    set_geometry(&block);
+}
+
+static int env_int(const char *name, int value) {
+    const char *env = getenv(name);
+    return env != NULL ? atoi(env) : value;
+}
+
 void disk_init(bool fresh) {
-    if (fresh)
-        init_fresh_disk(DISK_NAME, BLOCK_SIZE, MAX_BLOCK);
+    disk_close();
+    const char *backend = getenv(DISK_BACKEND_ENV);
+    if (backend != NULL && strcmp(backend, "mmap") == 0)
+        set_disk_backend(DISK_BACKEND_MMAP);
+    else if (backend != NULL && strcmp(backend, "uring") == 0)
+        set_disk_backend(DISK_BACKEND_URING);
     else
+        set_disk_backend(DISK_BACKEND_PREAD);
+    const char *depth = getenv(DISK_QUEUE_DEPTH_ENV);
+    set_disk_queue_depth(depth != NULL ? atoi(depth) : DISK_QUEUE_DEPTH);
+    if (fresh) {
+        int block_size = env_int(BLOCK_SIZE_ENV, DEFAULT_BLOCK_SIZE);
+        int inodes = env_int(INODE_COUNT_ENV, DEFAULT_INODE_COUNT);
+        int data_blocks = env_int(DATA_BLOCKS_ENV, DEFAULT_DATA_BLOCKS);
+        if (format_geometry(block_size, inodes, data_blocks) < 0) {
+            printf("Invalid disk geometry, using the default one\n");
+            format_geometry(DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT,
+                            DEFAULT_DATA_BLOCKS);
+        }
+        init_fresh_disk(DISK_NAME, BLOCK_SIZE, MAX_BLOCK);
+    } else {
+        read_geometry();
         init_disk(DISK_NAME, BLOCK_SIZE, MAX_BLOCK);
+    }
+
+    int cache_kb = BUFFER_CACHE_KB;
+    const char *env = getenv(BUFFER_CACHE_ENV);
+    if (env != NULL)
+        cache_kb = atoi(env);
+    // a mapped image needs no block cache
+    if (block_pointer(SUPER_BLOCK_ADDRESS) != NULL)
+        cache_kb = 0;
+    buffer_cache_init(cache_kb * 1024 / BLOCK_SIZE);
+    journal_open();
+
+    // the replay may have installed a newer super block (a committed inode
+    // table relocation)
+    if (!fresh) {
+        super_block block;
+        load_super_block(&block);
+        set_geometry(&block);
+    }
 }
 
-void deserialize(void *obj, int obj_size, int start_address, int num_blocks) {
+int disk_sync(void) { return journal_sync(); }
+
+void disk_close(void) {
+    journal_close();
+    buffer_cache_close();
+    close_disk();
+}
+
+/*
+ * Stages an object smaller than its blocks through a block sized buffer
+ */
+static void read_object(void *obj, int obj_size, int start_address,
+                        int num_blocks, int (*read)(int, int, void *)) {
     int size = num_blocks * BLOCK_SIZE;
+    // whole blocks need no staging buffer
+    if (obj_size == size) {
+        read(start_address, num_blocks, obj);
+        return;
+    }
     char *buffer = malloc(size);
     clear_buffer(buffer, size);
-    read_blocks(start_address, num_blocks, buffer);
+    read(start_address, num_blocks, buffer);
     memcpy(obj, buffer, obj_size);
+    COUNT_BYTES_COPIED(obj_size);
     free(buffer);
 }
 
-void serialize(void *obj, int obj_size, int start_address, int num_blocks) {
+static void write_object(const void *obj, int obj_size, int start_address,
+                         int num_blocks,
+                         int (*write)(int, int, const void *)) {
     int size = num_blocks * BLOCK_SIZE;
+    if (obj_size == size) {
+        write(start_address, num_blocks, obj);
+        return;
+    }
     char *buffer = malloc(size);
     clear_buffer(buffer, size);
     memcpy(buffer, obj, obj_size);
-    write_blocks(start_address, num_blocks, buffer);
+    COUNT_BYTES_COPIED(obj_size);
+    write(start_address, num_blocks, buffer);
     free(buffer);
 }
 
+void deserialize(void *obj, int obj_size, int start_address, int num_blocks) {
+    COUNT(deserialize_calls, 1);
+    // a mapped image is read in place unless the journal has a newer copy
+    char *block = block_pointer(start_address);
+    if (block != NULL && !journal_holds(start_address, num_blocks)) {
+        memcpy(obj, block, obj_size);
+        COUNT_BYTES_COPIED(obj_size);
+        return;
+    }
+    read_object(obj, obj_size, start_address, num_blocks, journal_read_blocks);
+}
+
+void serialize(void *obj, int obj_size, int start_address, int num_blocks) {
+    COUNT(serialize_calls, 1);
+    write_object(obj, obj_size, start_address, num_blocks,
+                 journal_write_blocks);
+}
+
 void load_data_block(int block_number, void *buf, int buf_size) {
-    deserialize(buf, buf_size, DATA_BLOCK_ADDRESS + block_number, SINGLE_BLOCK);
+    int address = DATA_BLOCK_ADDRESS + block_number;
+    char *block = block_pointer(address);
+    if (block != NULL) {
+        memcpy(buf, block, buf_size);
+        COUNT_BYTES_COPIED(buf_size);
+        return;
+    }
+    read_object(buf, buf_size, address, SINGLE_BLOCK, buffer_read_blocks);
 }
 
 void sync_data_block(int block_number, void *buf, int buf_size) {
-    serialize(buf, buf_size, DATA_BLOCK_ADDRESS + block_number, SINGLE_BLOCK);
+    int address = DATA_BLOCK_ADDRESS + block_number;
+    char *block = block_pointer(address);
+    if (block != NULL) {
+        memcpy(block, buf, buf_size);
+        clear_buffer(block + buf_size, BLOCK_SIZE - buf_size);
+        COUNT_BYTES_COPIED(buf_size);
+        return;
+    }
+    write_object(buf, buf_size, address, SINGLE_BLOCK, buffer_write_blocks);
 }
 
-void load_index_block(int block_number, index_block *block) {
-    load_data_block(block_number, block, sizeof(index_block));
+/*
+ * Returns a copy of the runs with disk addresses, NULL when there is none
+ * (a request may cover no whole block). The caller frees it
+ */
+static disk_request *translate_data_runs(const disk_request *runs, int count) {
+    if (count <= 0)
+        return NULL;
+    disk_request *requests = malloc(sizeof(disk_request) * count);
+    for (int i = 0; i < count; i++) {
+        requests[i] = runs[i];
+        requests[i].address += DATA_BLOCK_ADDRESS;
+    }
+    return requests;
 }
 
-void sync_index_block(int block_number, index_block *block) {
-    sync_data_block(block_number, block, sizeof(index_block));
+void load_data_runs(disk_request *runs, int count) {
+    disk_request *requests = translate_data_runs(runs, count);
+    if (requests != NULL)
+        buffer_read_runs(requests, count);
+    free(requests);
 }
 
-void clear_data_block(int block_number) {
-    char buf[BLOCK_SIZE];
-    for (int i = 0; i < BLOCK_SIZE; ++i) {
-        buf[i] = '0';
+int sync_data_runs(disk_request *runs, int count) {
+    disk_request *requests = translate_data_runs(runs, count);
+    int status = 0;
+    if (requests != NULL && buffer_write_runs(requests, count) < 0)
+        status = -1;
+    free(requests);
+    return status;
+}
+
+void prefetch_data_runs(disk_request *runs, int count) {
+    disk_request *requests = translate_data_runs(runs, count);
+    if (requests != NULL)
+        buffer_prefetch_runs(requests, count);
+    free(requests);
+}
+
+void load_index_block(int block_number, int *block) {
+    deserialize(block, BLOCK_SIZE, DATA_BLOCK_ADDRESS + block_number,
+                SINGLE_BLOCK);
+}
+
+void sync_index_block(int block_number, const int *block) {
+    serialize((void *)block, BLOCK_SIZE, DATA_BLOCK_ADDRESS + block_number,
+              SINGLE_BLOCK);
+}
+
+void load_dir_block(int block_number, void *buf, int buf_size) {
+    deserialize(buf, buf_size, DATA_BLOCK_ADDRESS + block_number,
+                SINGLE_BLOCK);
+}
+
+void sync_dir_block(int block_number, void *buf, int buf_size) {
+    serialize(buf, buf_size, DATA_BLOCK_ADDRESS + block_number, SINGLE_BLOCK);
+}
+
+void forget_data_blocks(int block_number, int count) {
+    buffer_discard(DATA_BLOCK_ADDRESS + block_number, count);
+    for (int i = 0; i < count; i++) {
+        journal_revoke(DATA_BLOCK_ADDRESS + block_number + i);
     }
-    sync_data_block(block_number, buf, BLOCK_SIZE);
+}
+
+void discard_data_blocks(int block_number, int count) {
+    discard_blocks(DATA_BLOCK_ADDRESS + block_number, count);
+}
+
+void zero_data_blocks(int block_number, int count) {
+    zero_blocks(DATA_BLOCK_ADDRESS + block_number, count);
 }
 
 void load_inodes(inode_table *inode_tb) {
@@ -72,17 +343,58 @@ void load_inodes(inode_table *inode_tb) {
 }
 
 void sync_inodes(inode_table *inode_tb) {
+    COUNT(inode_syncs, 1);
     serialize(inode_tb->inodes, INODE_COUNT * sizeof(inode),
               INODE_TABLE_ADDRESS, INODE_TABLE_SIZE);
 }
 
-void sync_fbm(free_byte_map *free_bm) {
-    serialize(free_bm->map, DATA_BLOCK_SIZE, FREE_BYTE_MAP_ADDRESS,
-              FREE_BYTE_MAP_SIZE);
+void load_legacy_inodes(legacy_inode *inodes) {
+    deserialize(inodes, LEGACY_INODE_COUNT * sizeof(legacy_inode),
+                LEGACY_INODE_TABLE_ADDRESS, LEGACY_INODE_TABLE_SIZE);
+}
+
+void sync_inode_blocks(inode_table *inode_tb, int first, int count) {
+    COUNT(inode_syncs, 1);
+    long offset = (long)first * BLOCK_SIZE;
+    int size = (int)min_long((long)count * BLOCK_SIZE,
+                             INODE_COUNT * sizeof(inode) - offset);
+    serialize((char *)inode_tb->inodes + offset, size,
+              INODE_TABLE_ADDRESS + first, count);
+}
+
+static void sync_bitmap_blocks(free_bitmap *map, int address, int first,
+                               int count) {
+    int offset = first * BLOCK_SIZE;
+    int size = min(count * BLOCK_SIZE, FREE_BITMAP_BYTES - offset);
+    serialize((char *)map->words + offset, size, address + first, count);
+}
+
+void sync_fbm(free_bitmap *free_bm) {
+    sync_fbm_blocks(free_bm, 0, FREE_BITMAP_SIZE);
 }
 
-void load_fbm(free_byte_map *free_bm) {
-    deserialize(free_bm->map, DATA_BLOCK_SIZE, FREE_BYTE_MAP_ADDRESS,
+void sync_fbm_blocks(free_bitmap *free_bm, int first, int count) {
+    COUNT(fbm_syncs, 1);
+    sync_bitmap_blocks(free_bm, FREE_BITMAP_ADDRESS, first, count);
+}
+
+void load_fbm(free_bitmap *free_bm) {
+    deserialize(free_bm->words, FREE_BITMAP_BYTES, FREE_BITMAP_ADDRESS,
+                FREE_BITMAP_SIZE);
+}
+
+void sync_reclaim_map_blocks(free_bitmap *reclaim_map, int first, int count) {
+    COUNT(reclaim_map_syncs, 1);
+    sync_bitmap_blocks(reclaim_map, RECLAIM_MAP_ADDRESS, first, count);
+}
+
+void load_reclaim_map(free_bitmap *reclaim_map) {
+    deserialize(reclaim_map->words, FREE_BITMAP_BYTES, RECLAIM_MAP_ADDRESS,
+                RECLAIM_MAP_SIZE);
+}
+
+void load_byte_map(free_byte_map *byte_map) {
+    deserialize(byte_map->map, LEGACY_DATA_BLOCK_SIZE, FREE_BYTE_MAP_ADDRESS,
                 FREE_BYTE_MAP_SIZE);
 }
 
@@ -96,14 +408,71 @@ void sync_super_block(super_block *block) {
               SUPER_BLOCK_SIZE);
 }
 
-void clear_index_block(index_block *block) {
+void clear_index_block(int *block) {
     for (int i = 0; i < INDEX_BLOCK_NUM_POINTER; ++i) {
-        block->data[i] = -1;
+        block[i] = -1;
     }
 }
 
 void init_super_block(void) {
-    super_block superBlock = {123, BLOCK_SIZE, MAX_BLOCK, INODE_TABLE_SIZE,
-                              ROOT_INODE};
+    super_block superBlock = {SFS_MAGIC,
+                              BLOCK_SIZE,
+                              MAX_BLOCK,
+                              INODE_TABLE_SIZE,
+                              ROOT_INODE,
+                              SFS_VERSION,
+                              INODE_COUNT,
+                              INODE_TABLE_ADDRESS,
+                              DATA_BLOCK_ADDRESS,
+                              DATA_BLOCK_SIZE,
+                              FREE_BITMAP_ADDRESS,
+                              FREE_BITMAP_SIZE,
+                              RECLAIM_MAP_ADDRESS,
+                              JOURNAL_ADDRESS,
+                              JOURNAL_SIZE};
     sync_super_block(&superBlock);
 }
+
+#define MAX_FORK_WORKERS 4
+
+static worker_fork_state *fork_workers[MAX_FORK_WORKERS];
+static int fork_worker_count;
+
+static void workers_before_fork(void) {
+    for (int i = fork_worker_count - 1; i >= 0; i--) {
+        for (int j = 0; j < 2 && fork_workers[i]->locks[j] != NULL; j++)
+            pthread_mutex_lock(fork_workers[i]->locks[j]);
+    }
+}
+
+static void unlock_worker(worker_fork_state *worker) {
+    for (int j = 1; j >= 0; j--) {
+        if (worker->locks[j] != NULL)
+            pthread_mutex_unlock(worker->locks[j]);
+    }
+}
+
+static void workers_after_fork_parent(void) {
+    for (int i = 0; i < fork_worker_count; i++)
+        unlock_worker(fork_workers[i]);
+}
+
+static void workers_after_fork_child(void) {
+    for (int i = 0; i < fork_worker_count; i++) {
+        worker_fork_state *worker = fork_workers[i];
+        *worker->running = false;
+        for (int j = 0; j < 2 && worker->conds[j] != NULL; j++)
+            pthread_cond_init(worker->conds[j], NULL);
+        unlock_worker(worker);
+    }
+}
+
+void register_worker_fork(worker_fork_state *worker) {
+    if (worker->registered || fork_worker_count == MAX_FORK_WORKERS)
+        return;
+    if (fork_worker_count == 0)
+        pthread_atfork(workers_before_fork, workers_after_fork_parent,
+                       workers_after_fork_child);
+    fork_workers[fork_worker_count++] = worker;
+    worker->registered = true;
+}
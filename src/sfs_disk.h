@@ -1,61 +1,203 @@
 #ifndef SFS_DISK_H
 #define SFS_DISK_H
 
+#include "disk_emu.h"
+#include "sfs_stats.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
- * File system dimensions
- * Supports 100 files of max size = 268 blocks
- * *Numbers (Filesystem, Super block, Inode table, Data blocks, FBM) are
- * expressed in blocks*
+ * File system dimensions, chosen when the disk is formatted and read from the
+ * super block at mount
+ * *Numbers (Filesystem, Super block, Inode table, Data blocks, FBM, Journal)
+ * are expressed in blocks*
  */
+typedef struct {
+    int block_size;
+    int num_blocks;
+    int inode_count;
+    int inode_table_address;
+    int inode_table_size;
+    int data_block_address;
+    int data_block_count;
+    int free_bitmap_address;
+    int bitmap_size; // blocks of the free bitmap, and of the reclaim map
+    int reclaim_map_address;
+    int journal_address;
+    int journal_size;
+    int max_file_blocks;
+} fs_geometry;
+
+extern fs_geometry geometry;
+
+// Format parameters, SFS_BLOCK_SIZE (bytes, a power of 2), SFS_INODE_COUNT
+// and SFS_DATA_BLOCKS override them when a fresh disk is made
+#define DEFAULT_BLOCK_SIZE 1024
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define DEFAULT_INODE_COUNT 100
+#define DEFAULT_DATA_BLOCKS 26800
+#define BLOCK_SIZE_ENV "SFS_BLOCK_SIZE"
+#define INODE_COUNT_ENV "SFS_INODE_COUNT"
+#define DATA_BLOCKS_ENV "SFS_DATA_BLOCKS"
 
 // Filesystem
-#define BLOCK_SIZE 1024
-#define MAX_BLOCK 26835
+#define BLOCK_SIZE geometry.block_size
+#define MAX_BLOCK geometry.num_blocks
 
 // Super block
 #define SUPER_BLOCK_ADDRESS 0
 #define SUPER_BLOCK_SIZE 1
 
 // Inode table
-#define INODE_TABLE_ADDRESS (SUPER_BLOCK_ADDRESS + SUPER_BLOCK_SIZE)
-#define INODE_TABLE_SIZE 7
+#define INODE_TABLE_ADDRESS geometry.inode_table_address
+#define INODE_TABLE_SIZE geometry.inode_table_size
+#define INODES_PER_BLOCK (BLOCK_SIZE / (int)sizeof(inode))
 
 // Data blocks
-#define DATA_BLOCK_ADDRESS (INODE_TABLE_ADDRESS + INODE_TABLE_SIZE)
-#define DATA_BLOCK_SIZE 26800
+#define DATA_BLOCK_ADDRESS geometry.data_block_address
+#define DATA_BLOCK_SIZE geometry.data_block_count
 
-// Index blocks
+// Index blocks, a file maps its blocks through the direct pointers, then a
+// single, a double and a triple indirect tree of index blocks
 #define INDEX_BLOCK_NUM_POINTER (BLOCK_SIZE / 4)
+#define INDIRECT_LEVELS 3
+
+// Free bitmap (1 bit = 1 used block)
+#define FREE_BITMAP_ADDRESS geometry.free_bitmap_address
+#define FREE_BITMAP_WORDS ((DATA_BLOCK_SIZE + 63) / 64)
+#define FREE_BITMAP_BYTES (FREE_BITMAP_WORDS * (int)sizeof(uint64_t))
+#define FREE_BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / 8)
+#define FREE_BITMAP_SIZE geometry.bitmap_size
+#define FREE_BITMAP_REGION_WORDS 8
+#define FREE_BITMAP_REGIONS                                                    \
+    ((FREE_BITMAP_WORDS + FREE_BITMAP_REGION_WORDS - 1) /                      \
+     FREE_BITMAP_REGION_WORDS)
+
+// Reclaim map (freed blocks waiting to be scrubbed), right after the bitmap
+#define RECLAIM_MAP_ADDRESS geometry.reclaim_map_address
+#define RECLAIM_MAP_SIZE FREE_BITMAP_SIZE
+
+// Journal, after the reclaim map. Block 0 of the region is the journal super
+// block, a transaction (its descriptor, images and commit block) always fits
+// in the log after it
+#define JOURNAL_ADDRESS geometry.journal_address
+#define JOURNAL_SIZE geometry.journal_size
+#define JOURNAL_BLOCKS 512
+#define JOURNAL_DESCRIPTOR_ENTRIES                                             \
+    (BLOCK_SIZE / 4 - 4 < JOURNAL_SIZE - 3 ? BLOCK_SIZE / 4 - 4               \
+                                           : JOURNAL_SIZE - 3)
 
-// FBM
-#define FREE_BYTE_MAP_ADDRESS (DATA_BLOCK_ADDRESS + DATA_BLOCK_SIZE)
+/*
+ * Layout of the disks made before version 4 (1 KiB blocks, 100 inodes of 64
+ * bytes). The free byte map of version 0 took the region that now holds the
+ * bitmap and the reclaim map, the journal was appended after it
+ */
+#define LEGACY_BLOCK_SIZE 1024
+#define LEGACY_INODE_COUNT 100
+#define LEGACY_INODE_TABLE_ADDRESS 1
+#define LEGACY_INODE_TABLE_SIZE 7
+#define LEGACY_DATA_BLOCK_ADDRESS 8
+#define LEGACY_DATA_BLOCK_SIZE 26800
+#define FREE_BYTE_MAP_ADDRESS 26808
 #define FREE_BYTE_MAP_SIZE 27
+#define LEGACY_JOURNAL_ADDRESS 26835
+#define LEGACY_MAX_BLOCK 27347
+
+// Group commit: a transaction commits once it holds this many blocks or
+// after the timer (SFS_COMMIT_MS overrides it), whichever comes first
+#define JOURNAL_COMMIT_BLOCKS 64
+#define JOURNAL_COMMIT_MS 5000
+#define JOURNAL_COMMIT_ENV "SFS_COMMIT_MS"
+
+// Buffer cache budget in KiB (the SFS_CACHE_KB env variable overrides it)
+#define BUFFER_CACHE_KB 4096
+#define BUFFER_CACHE_ENV "SFS_CACHE_KB"
+
+// Disk backend, "pread" (default), "mmap" (no buffer cache, the mapped
+// image is the cache) or "uring" (batches go through io_uring, pread where it
+// is not available)
+#define DISK_BACKEND_ENV "SFS_DISK_BACKEND"
+
+// Readahead window in blocks: it opens at the min on a sequential read,
+// doubles on every following one up to the max and closes on a random read
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+
+// Delayed allocation: small writes wait in a per-inode write buffer and get
+// their blocks when it is flushed (full, a write elsewhere in the file, close,
+// fsync, truncate, no buffer left or the timer, SFS_FLUSH_MS overrides it).
+// A buffer holds 32 KiB, or 2 blocks when they are larger
+#define WRITE_BUFFER_BYTES 32768
+#define WRITE_BUFFER_SIZE                                                      \
+    (BLOCK_SIZE * 2 > WRITE_BUFFER_BYTES ? BLOCK_SIZE * 2 : WRITE_BUFFER_BYTES)
+#define WRITE_BUFFER_COUNT 16
+#define WRITE_BUFFER_MS 5000
+#define WRITE_BUFFER_ENV "SFS_FLUSH_MS"
+
+// Requests the io_uring backend keeps in flight (SFS_QUEUE_DEPTH overrides it)
+#define DISK_QUEUE_DEPTH 32
+#define DISK_QUEUE_DEPTH_ENV "SFS_QUEUE_DEPTH"
+
+// How the reclaim worker scrubs freed blocks, "punch" (default, punch a hole
+// in the image), "zero" (write 0's) or "none"
+#define RECLAIM_SCRUB_ENV "SFS_SCRUB"
 
 /*
  * Filesystem metadata
  */
 #define DISK_NAME "disk"
+#define SFS_MAGIC 123
+#define SFS_VERSION_BYTE_MAP 0
+#define SFS_VERSION_BITMAP 1
+#define SFS_VERSION_RECLAIM 2
+#define SFS_VERSION_JOURNAL 3
+#define SFS_VERSION_GEOMETRY 4
+#define SFS_VERSION_HTREE 5
+#define SFS_VERSION_TREE 6
+#define SFS_VERSION SFS_VERSION_TREE
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4a445343
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54
 #define ROOT_INODE 0
-#define INODE_COUNT 100
+#define INODE_COUNT geometry.inode_count
 #define INODE_DIRECT_BLOCK_COUNT 12
 #define MAX_FILE_NAME_SIZE 20
 #define MAXFILENAME MAX_FILE_NAME_SIZE
 #define MAX_NUMBER_OF_DIRECTORY_ENTRIES (INODE_COUNT - 1)
-#define MAX_NUMBER_DIR_ENTRIES_PER_BLOCK 42
-#define MAX_DIR_BYTES_PER_BLOCK                                                \
-    (MAX_NUMBER_DIR_ENTRIES_PER_BLOCK * sizeof(directory_entry))
-#define PRE_ALLOCATED_DIR_BLOCKS 3
-#define DATA_BLOCKS_CONTENT_PER_FILE                                           \
-    (INODE_DIRECT_BLOCK_COUNT + (BLOCK_SIZE / 4))
-#define DATA_BLOCKS_PER_FILE (DATA_BLOCKS_CONTENT_PER_FILE + 1)
-#define MAX_BYTES_PER_FILE (DATA_BLOCKS_CONTENT_PER_FILE * BLOCK_SIZE)
+#define MAX_NUMBER_DIR_ENTRIES_PER_BLOCK                                       \
+    (BLOCK_SIZE / (int)sizeof(directory_entry))
+// the flat root directory of disks before version 5, entries packed from the
+// first slot of its pre allocated blocks
+#define FLAT_DIR_BLOCKS                                                        \
+    ((MAX_NUMBER_OF_DIRECTORY_ENTRIES + MAX_NUMBER_DIR_ENTRIES_PER_BLOCK -     \
+      1) /                                                                     \
+     MAX_NUMBER_DIR_ENTRIES_PER_BLOCK)
+// index blocks of a directory htree are marked by an empty entry (inode 0)
+// whose name is "\0" followed by this marker
+#define DX_MARKER "\0sfs-htree"
+// the root and at most 2 levels of index blocks under it
+#define DX_MAX_LEVELS 3
+#define DX_ENTRIES_PER_BLOCK                                                   \
+    ((BLOCK_SIZE - (int)sizeof(dx_block)) / (int)sizeof(dx_entry))
+// (directory, name) lookups kept in memory, found or missing
+#define DENTRY_CACHE_SIZE 8192
+#define MAX_BLOCKS_PER_FILE geometry.max_file_blocks
+#define MAX_BYTES_PER_FILE ((long)MAX_BLOCKS_PER_FILE * BLOCK_SIZE)
+
 /*
  * Inode modes
  */
 #define INODE_MODE_UNUSED 0
 #define INODE_MODE_USED 1
+#define INODE_MODE_DIR 2
+
+/*
+ * link_cnt of a file removed while open: it has no directory entry and is
+ * freed at its last close, or at the next mount after a crash
+ */
+#define INODE_LINK_ORPHAN 0
 
 /*
  * Misc
@@ -71,39 +213,97 @@ typedef struct {
     int num_blocks;
     int num_inode_blocks;
     int root_inode;
+    int version;
+    // version 4: where every region is (older disks use the legacy layout)
+    int inode_count;
+    int inode_table_address;
+    int data_block_address;
+    int data_block_count;
+    int free_bitmap_address;
+    int bitmap_size;
+    int reclaim_map_address;
+    int journal_address;
+    int journal_size;
 } super_block;
 
 /*
- * Inode def
+ * Inode def (128 bytes, a block holds a whole number of them). The indirect
+ * pointers are the roots of trees of 1, 2 and 3 levels of index blocks
  */
 typedef struct {
     int mode;
     int link_cnt;
-    int size;
+    int64_t size;
     int direct[INODE_DIRECT_BLOCK_COUNT];
     int indirect;
+    int double_indirect;
+    int triple_indirect;
+    int reserved[13];
 } inode;
 
+/*
+ * Inode of the disks made before version 4, only read to migrate them
+ */
+typedef struct {
+    int mode;
+    int link_cnt;
+    int size;
+    int direct[INODE_DIRECT_BLOCK_COUNT];
+    int indirect;
+} legacy_inode;
+
 /*
  * Inode table
  */
 typedef struct {
-    inode inodes[INODE_COUNT];
+    inode *inodes;
 } inode_table;
 
 /*
- * Index block
+ * Free byte map (format version 0, only read to migrate old disks)
  */
 typedef struct {
-    int data[INDEX_BLOCK_NUM_POINTER];
-} index_block;
+    char map[LEGACY_DATA_BLOCK_SIZE];
+} free_byte_map;
 
 /*
- * Free byte map
+ * Free bitmap, 64 data blocks per word
  */
 typedef struct {
-    char map[DATA_BLOCK_SIZE];
-} free_byte_map;
+    uint64_t *words;
+} free_bitmap;
+
+/*
+ * Extent, a run of consecutive data blocks
+ */
+typedef struct {
+    int start;
+    int length;
+} extent;
+
+/*
+ * Journal defs. The log starts after the journal super block, a transaction
+ * is a descriptor block, the images of the logged blocks and a commit block
+ */
+typedef struct {
+    int magic;
+    int sequence; // sequence of the first transaction in the log
+} journal_super_block;
+
+typedef struct {
+    int magic;
+    int sequence;
+    int block_count;
+    int revoke_count;
+    // addresses of the logged blocks, then the revoked ones
+    int addresses[];
+} journal_descriptor;
+
+typedef struct {
+    int magic;
+    int sequence;
+    uint32_t checksum; // crc32 of the descriptor and the block images
+} journal_commit_block;
 
 /*
  * Directory type defs
@@ -113,69 +313,153 @@ typedef struct {
     int inode;
 } directory_entry;
 
+/*
+ * Index block of a directory htree. The entries are sorted by hash, entry i
+ * covers the name hashes from its hash up to the hash of entry i + 1 and
+ * points to a directory file block (a leaf, or an index block one level
+ * down). The first entry has hash 0
+ */
+typedef struct {
+    uint32_t hash;
+    int block;
+} dx_entry;
+
 typedef struct {
-    directory_entry entries[MAX_NUMBER_OF_DIRECTORY_ENTRIES];
-} directory;
+    directory_entry header; // see DX_MARKER
+    int levels;             // index levels under the root, root only
+    int count;
+    dx_entry entries[];
+} dx_block;
 
 /*
- * FD
+ * FD, one per open: each open of a file has its own pointer and readahead
  */
 typedef struct {
     int inode;
-    int op_pointer;
+    long op_pointer;
+    // the file was removed, its inode is freed when its last fd is closed
+    bool unlinked;
+    // readahead: offset where the last read ended, window in blocks and the
+    // first file block past what was prefetched
+    long ra_offset;
+    int ra_window;
+    int ra_end;
 } file_descriptor;
 
 typedef struct {
-    file_descriptor entries[MAX_NUMBER_OF_DIRECTORY_ENTRIES];
+    file_descriptor *entries;
 } file_descriptor_table;
 
+/*
+ * Write buffer: bytes [start, start + length) of a file that are not on the
+ * disk yet, and the free blocks reserved for its flush
+ */
+typedef struct {
+    long start;
+    int length;
+    char *data;
+    int reserved;
+} write_buffer;
+
 void clear_buffer(char *, int);
 
-int divide_round_up(int, int);
+long divide_round_up(long, long);
 
 int min(int, int);
 
+long min_long(long, long);
+
 /*
- * wrapper over init
+ * wrapper over init, also sets up the buffer cache and replays the journal. A
+ * fresh disk gets its geometry from the format parameters, an existing one
+ * from its super block
  */
 void disk_init(bool);
 
+/*
+ * Commits the journal, writes every dirty cached block to the disk and makes
+ * it durable. Returns -1 if the journal could not be written
+ */
+int disk_sync(void);
+
+/*
+ * Checkpoints the journal, flushes the buffer cache and closes the disk
+ */
+void disk_close(void);
+
 /**
  *
- * Reads an object from the disk (deserialize)
+ * Reads a metadata object from the disk (deserialize), through the journal
  */
 void deserialize(void *, int, int, int);
 
 /**
  *
- * Writes an object into the disk (serialize)
+ * Writes a metadata object into the disk (serialize), it is logged in the
+ * journal and written in place once committed
  */
 void serialize(void *, int, int, int);
 
 /*
- * Load one data block
+ * Load one data block (file data, not journaled)
  */
 void load_data_block(int, void *, int);
 
 /*
- * Sync one data block
+ * Sync one data block (file data, not journaled)
  */
 void sync_data_block(int, void *, int);
 
 /*
- * Loads an index block
+ * Loads and writes a batch of whole data block runs straight between the
+ * buffers and the disk (addresses are data block numbers, the buffer cache is
+ * only used for blocks it already holds). The write returns -1 if it fails
+ */
+void load_data_runs(disk_request *, int);
+
+int sync_data_runs(disk_request *, int);
+
+/*
+ * Reads a batch of data block runs into the buffer cache ahead of the reader
+ * (nothing happens when the cache is off)
+ */
+void prefetch_data_runs(disk_request *, int);
+
+/*
+ * Loads an index block (INDEX_BLOCK_NUM_POINTER block numbers)
  */
-void load_index_block(int, index_block *);
+void load_index_block(int, int *);
 
 /*
  * Syncs an index block
  */
-void sync_index_block(int, index_block *);
+void sync_index_block(int, const int *);
+
+/*
+ * Loads a directory block
+ */
+void load_dir_block(int, void *, int);
+
+/*
+ * Syncs a directory block
+ */
+void sync_dir_block(int, void *, int);
+
+/*
+ * Drops the cached copies of freed data blocks (first block, number of blocks)
+ * and revokes their journaled images
+ */
+void forget_data_blocks(int, int);
+
+/*
+ * Punches a hole over freed data blocks, writes 0s if the disk cannot
+ */
+void discard_data_blocks(int, int);
 
 /*
- * writes 0s to a block to clear it
+ * Writes 0s over data blocks
  */
-void clear_data_block(int);
+void zero_data_blocks(int, int);
 
 /*
  * loads the inode table from the disk into the cache
@@ -187,15 +471,47 @@ void load_inodes(inode_table *);
  */
 void sync_inodes(inode_table *);
 
+/*
+ * Loads the inode table of a disk made before version 4
+ */
+void load_legacy_inodes(legacy_inode *);
+
+/*
+ * Sync a range of inode table blocks (first block, number of blocks) into the
+ * disk
+ */
+void sync_inode_blocks(inode_table *, int, int);
+
 /*
  * Sync a memory fbm into the disk
  */
-void sync_fbm(free_byte_map *);
+void sync_fbm(free_bitmap *);
+
+/*
+ * Sync a range of fbm blocks (first block, number of blocks) into the disk
+ */
+void sync_fbm_blocks(free_bitmap *, int, int);
 
 /*
  * Load the fbm from the disk into memory
  */
-void load_fbm(free_byte_map *);
+void load_fbm(free_bitmap *);
+
+/*
+ * Sync a range of reclaim map blocks (first block, number of blocks) into the
+ * disk
+ */
+void sync_reclaim_map_blocks(free_bitmap *, int, int);
+
+/*
+ * Load the reclaim map from the disk into memory
+ */
+void load_reclaim_map(free_bitmap *);
+
+/*
+ * Load a version 0 free byte map from the disk into memory
+ */
+void load_byte_map(free_byte_map *);
 
 /*
  * Load the super block from the disk into memory
@@ -210,11 +526,33 @@ void sync_super_block(super_block *);
 /*
  * Clear index block
  */
-void clear_index_block(index_block *);
+void clear_index_block(int *);
 
 /*
- * Init the super block in the disk
+ * Init the super block in the disk (current version and geometry)
  */
 void init_super_block(void);
 
+/*
+ * Background thread of a layer (reclaim worker, committer, flusher): the
+ * locks it runs under, in lock order, and its condition variables
+ */
+typedef struct {
+    pthread_mutex_t *locks[2];
+    pthread_cond_t *conds[2];
+    bool *running;
+    bool registered;
+} worker_fork_state;
+
+/*
+ * Only the forking thread survives a fork. The locks of every registered
+ * worker are held across it so the child does not inherit them locked, and
+ * the child forgets the workers: running is cleared and the condition
+ * variables, which may still count the parent's waiters, are set up again.
+ * A worker registered later may take the locks of earlier ones (the flusher
+ * runs operations, commits take the allocator lock), so its locks are taken
+ * first. Called when the worker starts, registers it once
+ */
+void register_worker_fork(worker_fork_state *);
+
 #endif
@@ -0,0 +1,540 @@
+#include "sfs_journal.h"
+#include "disk_emu.h"
+#include "sfs_buffer.h"
+#include "sfs_disk.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Running transaction: images of the metadata blocks logged since the last
+ * commit and the blocks revoked in it
+ */
+static int *txn_addresses;
+
+static char *txn_images;
+
+static int txn_blocks;
+
+static int *txn_revokes;
+
+static int txn_revoke_count;
+
+/*
+ * Next free log block, sequence of the next transaction and blocks with an
+ * image in the log (they need a revoke when freed)
+ */
+static int log_head;
+
+static int next_sequence;
+
+static uint64_t *logged;
+
+static bool is_open;
+
+/*
+ * Running operations, the credits they reserved (blocks they may still log),
+ * whether one of them logged a block and whether a commit is due once they
+ * end. A wanted commit holds back new operations until the running ones end
+ */
+static int active_ops;
+
+static int reserved_credits;
+
+static __thread int op_credits;
+
+static bool op_logged;
+
+static bool commit_wanted;
+
+/*
+ * Set when a block could not be logged (the transaction was full and could
+ * not commit). Nothing commits anymore, the disk keeps the last committed
+ * state and new operations fail with EIO until the next mount
+ */
+static bool aborted;
+
+static int commit_ms;
+
+static void (*commit_hook)(void);
+
+static bool committer_running;
+
+static bool committer_stop;
+
+static pthread_t committer_thread;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t committer_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_cond_t op_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t crc32(uint32_t crc, const void *data, int size) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    const unsigned char *bytes = data;
+    crc = ~crc;
+    for (int i = 0; i < size; i++)
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static char *txn_image(int entry) {
+    return txn_images + (size_t)entry * BLOCK_SIZE;
+}
+
+static int find_entry(int address) {
+    for (int i = 0; i < txn_blocks; i++) {
+        if (txn_addresses[i] == address)
+            return i;
+    }
+    return -1;
+}
+
+static bool is_logged(int address) {
+    return (logged[address / 64] >> (address % 64)) & 1;
+}
+
+static int write_journal_super_block(void) {
+    char block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+    journal_super_block *jsb = (journal_super_block *)block;
+    jsb->magic = JOURNAL_MAGIC;
+    jsb->sequence = next_sequence;
+    return write_blocks(JOURNAL_ADDRESS, SINGLE_BLOCK, block);
+}
+
+/*
+ * Writes every committed block in place and empties the log. Returns -1 and
+ * keeps the log if a write fails
+ */
+static int checkpoint(void) {
+    if (buffer_flush() < 0 || sync_disk() < 0 ||
+        write_journal_super_block() < 0 || sync_disk() < 0)
+        return -1;
+    log_head = 1;
+    memset(logged, 0, sizeof(uint64_t) * divide_round_up(MAX_BLOCK, 64));
+    return 0;
+}
+
+/*
+ * Writes the descriptor, the images and the commit block of the running
+ * transaction at the head of the log and syncs them
+ */
+static int append_transaction(void) {
+    journal_descriptor *descriptor = calloc(1, BLOCK_SIZE);
+    descriptor->magic = JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor->sequence = next_sequence;
+    descriptor->block_count = txn_blocks;
+    descriptor->revoke_count = txn_revoke_count;
+    memcpy(descriptor->addresses, txn_addresses, sizeof(int) * txn_blocks);
+    memcpy(descriptor->addresses + txn_blocks, txn_revokes,
+           sizeof(int) * txn_revoke_count);
+
+    journal_commit_block *commit_block = calloc(1, BLOCK_SIZE);
+    commit_block->magic = JOURNAL_COMMIT_MAGIC;
+    commit_block->sequence = next_sequence;
+    commit_block->checksum = crc32(0, descriptor, BLOCK_SIZE);
+    commit_block->checksum = crc32(commit_block->checksum, txn_images,
+                                   txn_blocks * BLOCK_SIZE);
+
+    // one sequential write, a torn one fails the checksum on replay
+    void *bufs[JOURNAL_DESCRIPTOR_ENTRIES + 2];
+    bufs[0] = descriptor;
+    for (int i = 0; i < txn_blocks; i++) {
+        bufs[i + 1] = txn_image(i);
+    }
+    bufs[txn_blocks + 1] = commit_block;
+    int written = writev_blocks(JOURNAL_ADDRESS + log_head, txn_blocks + 2,
+                                bufs);
+    free(descriptor);
+    free(commit_block);
+    return written < 0 || sync_disk() < 0 ? -1 : 0;
+}
+
+/*
+ * Appends the running transaction to the log (called with the journal lock
+ * held and no operation halfway through its changes). Returns -1 if the file
+ * data or the log could not be written, the transaction then stays running
+ * and nothing is installed
+ */
+static int commit(void) {
+    if (aborted)
+        return -1;
+    commit_wanted = false;
+    if (txn_blocks == 0 && txn_revoke_count == 0)
+        return 0;
+    // ordered mode: file data is on the disk before metadata pointing at it
+    if ((log_head + txn_blocks + 2 > JOURNAL_SIZE && checkpoint() < 0) ||
+        buffer_flush() < 0 || sync_disk() < 0 || append_transaction() < 0) {
+        commit_wanted = true;
+        return -1;
+    }
+
+    // committed blocks go in place through the cache
+    for (int i = 0; i < txn_blocks; i++) {
+        buffer_write_blocks(txn_addresses[i], SINGLE_BLOCK, txn_image(i));
+        logged[txn_addresses[i] / 64] |= (uint64_t)1 << (txn_addresses[i] % 64);
+    }
+    COUNT(journal_commits, 1);
+    COUNT(journal_blocks, txn_blocks);
+    log_head += txn_blocks + 2;
+    next_sequence++;
+    txn_blocks = 0;
+    txn_revoke_count = 0;
+    op_logged = false;
+    if (commit_hook != NULL)
+        commit_hook();
+    return 0;
+}
+
+/*
+ * Makes room for one more entry in the running transaction. Operations
+ * reserve their credits so it never fills while one is running, only a write
+ * outside any operation (at mount) can find it full and commit. Aborts the
+ * journal and returns -1 when there is no room
+ */
+static int make_room(void) {
+    if (txn_blocks + txn_revoke_count < JOURNAL_DESCRIPTOR_ENTRIES)
+        return 0;
+    if (active_ops == 0 && commit() == 0)
+        return 0;
+    aborted = true;
+    return -1;
+}
+
+/*
+ * Reads one transaction of the log at the given block and checks it.
+ * Returns the number of log blocks it takes, 0 if there is none
+ */
+static int read_transaction(int head, int sequence,
+                            journal_descriptor *descriptor, char **images) {
+    if (head + 2 > JOURNAL_SIZE)
+        return 0;
+    read_blocks(JOURNAL_ADDRESS + head, SINGLE_BLOCK, descriptor);
+    int count = descriptor->block_count;
+    if (descriptor->magic != JOURNAL_DESCRIPTOR_MAGIC ||
+        descriptor->sequence != sequence || count < 0 ||
+        descriptor->revoke_count < 0 ||
+        count + descriptor->revoke_count > JOURNAL_DESCRIPTOR_ENTRIES ||
+        head + count + 2 > JOURNAL_SIZE)
+        return 0;
+
+    *images = malloc((size_t)(count + 1) * BLOCK_SIZE);
+    read_blocks(JOURNAL_ADDRESS + head + 1, count + 1, *images);
+    journal_commit_block *commit_block =
+        (journal_commit_block *)(*images + (size_t)count * BLOCK_SIZE);
+    uint32_t checksum = crc32(0, descriptor, BLOCK_SIZE);
+    checksum = crc32(checksum, *images, count * BLOCK_SIZE);
+    if (commit_block->magic != JOURNAL_COMMIT_MAGIC ||
+        commit_block->sequence != sequence ||
+        commit_block->checksum != checksum) {
+        free(*images);
+        return 0;
+    }
+    return count + 2;
+}
+
+/*
+ * Writes the images of every committed transaction in place, except images
+ * older than a revoke of their block
+ */
+static void replay(void) {
+    journal_descriptor *descriptor = malloc(BLOCK_SIZE);
+    int *revoked_at = malloc(sizeof(int) * MAX_BLOCK);
+    for (int i = 0; i < MAX_BLOCK; i++) {
+        revoked_at[i] = -1;
+    }
+
+    // first pass: find the committed transactions and their revokes
+    int first_sequence = next_sequence;
+    int head = 1;
+    char *images;
+    int length;
+    while ((length = read_transaction(head, next_sequence, descriptor,
+                                      &images)) > 0) {
+        for (int i = 0; i < descriptor->revoke_count; i++) {
+            int address = descriptor->addresses[descriptor->block_count + i];
+            if (address >= 0 && address < MAX_BLOCK)
+                revoked_at[address] = next_sequence;
+        }
+        free(images);
+        head += length;
+        next_sequence++;
+    }
+
+    // second pass: install them in order
+    head = 1;
+    for (int sequence = first_sequence; sequence < next_sequence; sequence++) {
+        length = read_transaction(head, sequence, descriptor, &images);
+        for (int i = 0; i < descriptor->block_count; i++) {
+            int address = descriptor->addresses[i];
+            if (address < 0 || address >= MAX_BLOCK ||
+                revoked_at[address] >= sequence)
+                continue;
+            write_blocks(address, SINGLE_BLOCK,
+                         images + (size_t)i * BLOCK_SIZE);
+        }
+        free(images);
+        head += length;
+    }
+    free(revoked_at);
+    free(descriptor);
+}
+
+void journal_open(void) {
+    pthread_mutex_lock(&journal_lock);
+    // sized for the geometry of the disk
+    free(txn_images);
+    free(txn_addresses);
+    free(txn_revokes);
+    free(logged);
+    txn_images = malloc((size_t)JOURNAL_DESCRIPTOR_ENTRIES * BLOCK_SIZE);
+    txn_addresses = malloc(sizeof(int) * JOURNAL_DESCRIPTOR_ENTRIES);
+    txn_revokes = malloc(sizeof(int) * JOURNAL_DESCRIPTOR_ENTRIES);
+    logged = malloc(sizeof(uint64_t) * divide_round_up(MAX_BLOCK, 64));
+    txn_blocks = 0;
+    txn_revoke_count = 0;
+    active_ops = 0;
+    reserved_credits = 0;
+    op_logged = false;
+    commit_wanted = false;
+    aborted = false;
+
+    commit_ms = JOURNAL_COMMIT_MS;
+    const char *env = getenv(JOURNAL_COMMIT_ENV);
+    if (env != NULL && atoi(env) > 0)
+        commit_ms = atoi(env);
+
+    char block[BLOCK_SIZE];
+    read_blocks(JOURNAL_ADDRESS, SINGLE_BLOCK, block);
+    journal_super_block *jsb = (journal_super_block *)block;
+    if (jsb->magic == JOURNAL_MAGIC) {
+        next_sequence = jsb->sequence;
+        replay();
+    } else {
+        next_sequence = 1;
+    }
+    // start again from an empty log
+    checkpoint();
+    is_open = true;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static void *committer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    while (!committer_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += commit_ms / 1000;
+        deadline.tv_nsec += (long)(commit_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&committer_cond, &journal_lock, &deadline);
+        if (committer_stop || !is_open)
+            continue;
+        if (active_ops == 0)
+            commit();
+        else
+            commit_wanted = true;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+static worker_fork_state committer_fork = {
+    {&journal_lock, NULL}, {&committer_cond, &op_cond}, &committer_running};
+
+void journal_start(void) {
+    register_worker_fork(&committer_fork);
+    if (committer_running)
+        return;
+    committer_stop = false;
+    if (pthread_create(&committer_thread, NULL, committer, NULL) == 0)
+        committer_running = true;
+}
+
+void journal_close(void) {
+    if (committer_running) {
+        pthread_mutex_lock(&journal_lock);
+        committer_stop = true;
+        pthread_cond_signal(&committer_cond);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(committer_thread, NULL);
+        committer_running = false;
+    }
+    pthread_mutex_lock(&journal_lock);
+    if (is_open) {
+        commit();
+        checkpoint();
+        is_open = false;
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_begin_op(int credits) {
+    if (credits > JOURNAL_DESCRIPTOR_ENTRIES)
+        credits = JOURNAL_DESCRIPTOR_ENTRIES;
+    pthread_mutex_lock(&journal_lock);
+    // wait for a wanted commit, or for one that makes room for the credits
+    int status = aborted ? -1 : 0;
+    while (status == 0 &&
+           (commit_wanted || txn_blocks + txn_revoke_count + reserved_credits +
+                                     credits >
+                                 JOURNAL_DESCRIPTOR_ENTRIES)) {
+        if (active_ops == 0) {
+            status = commit();
+            continue;
+        }
+        commit_wanted = true;
+        pthread_cond_wait(&op_cond, &journal_lock);
+        status = aborted ? -1 : 0;
+    }
+    if (status == 0) {
+        active_ops++;
+        reserved_credits += credits;
+        op_credits = credits;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    if (status < 0)
+        errno = EIO;
+    return status;
+}
+
+void journal_end_op(void) {
+    pthread_mutex_lock(&journal_lock);
+    active_ops--;
+    reserved_credits -= op_credits;
+    op_credits = 0;
+    if (active_ops == 0) {
+        if (commit_wanted ||
+            txn_blocks + txn_revoke_count >= JOURNAL_COMMIT_BLOCKS)
+            commit();
+        op_logged = false;
+        pthread_cond_broadcast(&op_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_read_blocks(int address, int nblocks, void *buf) {
+    char *out = buf;
+    int status = nblocks;
+    pthread_mutex_lock(&journal_lock);
+    int i = 0;
+    while (i < nblocks) {
+        int entry = find_entry(address + i);
+        if (entry >= 0) {
+            memcpy(out + (size_t)i * BLOCK_SIZE, txn_image(entry), BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < nblocks && find_entry(address + i + run) < 0)
+            run++;
+        /*
+         * read without the lock, the caller's lock on the owner of the blocks
+         * (an inode for its index block) keeps them from being logged now
+         */
+        pthread_mutex_unlock(&journal_lock);
+        int read = buffer_read_blocks(address + i, run,
+                                      out + (size_t)i * BLOCK_SIZE);
+        pthread_mutex_lock(&journal_lock);
+        if (read < 0) {
+            status = -1;
+            break;
+        }
+        i += run;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return status;
+}
+
+int journal_write_blocks(int address, int nblocks, const void *buf) {
+    const char *in = buf;
+    pthread_mutex_lock(&journal_lock);
+    for (int i = 0; i < nblocks; i++) {
+        int entry = find_entry(address + i);
+        if (entry < 0 && make_room() < 0) {
+            pthread_mutex_unlock(&journal_lock);
+            return -1;
+        }
+        if (entry < 0) {
+            entry = txn_blocks++;
+            txn_addresses[entry] = address + i;
+        }
+        memcpy(txn_image(entry), in + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    if (active_ops > 0)
+        op_logged = true;
+    pthread_mutex_unlock(&journal_lock);
+    return nblocks;
+}
+
+bool journal_holds(int address, int nblocks) {
+    pthread_mutex_lock(&journal_lock);
+    bool holds = false;
+    for (int i = 0; i < nblocks && !holds; i++) {
+        holds = find_entry(address + i) >= 0;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return holds;
+}
+
+void journal_revoke(int address) {
+    pthread_mutex_lock(&journal_lock);
+    int entry = find_entry(address);
+    if (entry >= 0) {
+        txn_blocks--;
+        if (entry != txn_blocks) {
+            txn_addresses[entry] = txn_addresses[txn_blocks];
+            memcpy(txn_image(entry), txn_image(txn_blocks), BLOCK_SIZE);
+        }
+    }
+    if (is_logged(address) && make_room() == 0) {
+        txn_revokes[txn_revoke_count++] = address;
+        logged[address / 64] &= ~((uint64_t)1 << (address % 64));
+    }
+    if (active_ops > 0)
+        op_logged = true;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_sync(void) {
+    pthread_mutex_lock(&journal_lock);
+    while (active_ops > 0) {
+        commit_wanted = true;
+        pthread_cond_wait(&op_cond, &journal_lock);
+    }
+    int status = commit();
+    if (status == 0 && (buffer_flush() < 0 || sync_disk() < 0))
+        status = -1;
+    pthread_mutex_unlock(&journal_lock);
+    return status;
+}
+
+bool journal_commit_early(void) {
+    pthread_mutex_lock(&journal_lock);
+    bool committed = false;
+    if (active_ops <= 1 && !op_logged &&
+        (txn_blocks > 0 || txn_revoke_count > 0) && commit() == 0) {
+        committed = true;
+        pthread_cond_broadcast(&op_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return committed;
+}
+
+void journal_set_commit_hook(void (*hook)(void)) { commit_hook = hook; }
@@ -0,0 +1,79 @@
+#ifndef SFS_JOURNAL_H
+#define SFS_JOURNAL_H
+
+#include <stdbool.h>
+
+/*
+ * Opens the journal of the mounted disk and replays every committed
+ * transaction into place (a journal that was never written is empty)
+ */
+void journal_open(void);
+
+/*
+ * Commits the running transaction, checkpoints the log and stops the commit
+ * thread
+ */
+void journal_close(void);
+
+/*
+ * Starts the thread that commits the running transaction on a timer
+ */
+void journal_start(void);
+
+/*
+ * Marks the start and end of a file system operation that changes metadata.
+ * A transaction is only committed when no operation is running, so it never
+ * holds half of one. An operation reserves credits, the most blocks it may
+ * log, and waits while a commit is wanted or the running transaction has no
+ * room left for them (the running operations end, then it commits). Returns
+ * -1 with errno EIO, and the operation must not run, if that commit fails or
+ * the journal was aborted
+ */
+int journal_begin_op(int);
+
+void journal_end_op(void);
+
+/*
+ * Reads consecutive metadata blocks, blocks logged in the running
+ * transaction are served from it
+ */
+int journal_read_blocks(int, int, void *);
+
+/*
+ * Logs consecutive metadata blocks in the running transaction, they are
+ * written in place once it commits. A block that finds no room aborts the
+ * journal: nothing commits anymore and the next operations fail with EIO,
+ * the disk stays as the last commit left it
+ */
+int journal_write_blocks(int, int, const void *);
+
+/*
+ * Returns true if any of the blocks is logged in the running transaction
+ */
+bool journal_holds(int, int);
+
+/*
+ * A logged block was freed: drops it from the running transaction and makes
+ * replay skip its older images (it may be reused for file data)
+ */
+void journal_revoke(int);
+
+/*
+ * Commits the running transaction and writes every cached block in place.
+ * If an operation is running it waits until the last one ends. Returns -1 if
+ * the log could not be written
+ */
+int journal_sync(void);
+
+/*
+ * Commits from inside an operation that has not logged anything yet (all
+ * logged changes belong to finished operations). Returns true on commit
+ */
+bool journal_commit_early(void);
+
+/*
+ * Called after every commit
+ */
+void journal_set_commit_hook(void (*)(void));
+
+#endif
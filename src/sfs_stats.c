@@ -0,0 +1,273 @@
+#include "sfs_stats.h"
+#include "disk_emu.h"
+#include "sfs_buffer.h"
+#include "sfs_disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+sfs_counters counters;
+
+typedef struct {
+    long count;
+    long sum;
+    long max;
+    long buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+static latency_histogram histograms[OP_COUNT];
+
+static const char *op_names[OP_COUNT] = {
+    "getattr", "readdir", "open",   "read",     "write",
+    "release", "create",  "unlink", "truncate", "fsync",
+    "mkdir",   "rmdir",
+};
+
+static int dump_fd = STDERR_FILENO;
+
+/*
+ * Text is built without stdio so the signal handler can use it, the buffer
+ * always ends with a '\0'
+ */
+static int append_text(char *buf, int size, int length, const char *text) {
+    while (*text != '\0' && length < size - 1) {
+        buf[length++] = *text++;
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+static int append_long(char *buf, int size, int length, long value) {
+    char digits[24];
+    int n = sizeof(digits) - 1;
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    digits[n] = '\0';
+    do {
+        digits[--n] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    if (value < 0)
+        digits[--n] = '-';
+    return append_text(buf, size, length, digits + n);
+}
+
+static int append(char *buf, int size, int length, const char *name,
+                  long value) {
+    length = append_text(buf, size, length, name);
+    length = append_text(buf, size, length, " ");
+    length = append_long(buf, size, length, value);
+    return append_text(buf, size, length, "\n");
+}
+
+static long load(long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+int sfs_stats_format(char *buf, int size) {
+    disk_stats disk;
+    buffer_cache_stats cache;
+    disk_get_stats(&disk);
+    buffer_cache_get_stats(&cache);
+    if (size <= 0)
+        return 0;
+    buf[0] = '\0';
+
+    struct {
+        const char *name;
+        long value;
+    } lines[] = {
+        {"disk.read_calls", disk.read_requests},
+        {"disk.read_bytes", disk.blocks_read * BLOCK_SIZE},
+        {"disk.write_calls", disk.write_requests},
+        {"disk.write_bytes", disk.blocks_written * BLOCK_SIZE},
+        {"disk.syncs", disk.syncs},
+        {"cache.hits", cache.hits},
+        {"cache.misses", cache.misses},
+        {"cache.writebacks", cache.writebacks},
+        {"cache.evictions", cache.evictions},
+        {"cache.bypassed", cache.bypassed},
+        {"cache.readahead", cache.readahead},
+        {"cache.readahead_hits", cache.readahead_hits},
+        {"cache.readahead_wasted", cache.readahead_wasted},
+        {"journal.commits", load(&counters.journal_commits)},
+        {"journal.blocks", load(&counters.journal_blocks)},
+        {"meta.serialize_calls", load(&counters.serialize_calls)},
+        {"meta.deserialize_calls", load(&counters.deserialize_calls)},
+        {"meta.fbm_syncs", load(&counters.fbm_syncs)},
+        {"meta.reclaim_map_syncs", load(&counters.reclaim_map_syncs)},
+        {"meta.inode_syncs", load(&counters.inode_syncs)},
+        {"meta.dir_block_syncs", load(&counters.dir_block_syncs)},
+        {"alloc.calls", load(&counters.alloc_calls)},
+        {"alloc.words_scanned", load(&counters.alloc_words_scanned)},
+        {"alloc.regions_skipped", load(&counters.alloc_regions_skipped)},
+        {"dir.lookups", load(&counters.dir_lookups)},
+        {"dir.probes", load(&counters.dir_probes)},
+        {"dir.dcache_hits", load(&counters.dcache_hits)},
+        {"dir.dcache_negative_hits", load(&counters.dcache_negative_hits)},
+        {"bmap.lookups", load(&counters.bmap_lookups)},
+        {"bmap.loads", load(&counters.bmap_loads)},
+        {"api.bytes_served", load(&counters.bytes_served)},
+        {"api.bytes_copied", load(&counters.bytes_copied)},
+        {"api.write_buffer_errors", load(&counters.write_buffer_errors)},
+    };
+    int length = 0;
+    for (int i = 0; i < (int)(sizeof(lines) / sizeof(lines[0])); i++) {
+        length = append(buf, size, length, lines[i].name, lines[i].value);
+    }
+    return length;
+}
+
+void sfs_stats_reset(void) {
+    disk_reset_stats();
+    buffer_cache_reset_stats();
+    long *fields = (long *)&counters;
+    for (int i = 0; i < (int)(sizeof(counters) / sizeof(long)); i++) {
+        __atomic_store_n(&fields[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+long sfs_latency_start(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int latency_bucket(long value) {
+    if (value < LATENCY_SUB_BUCKETS)
+        return value < 0 ? 0 : (int)value;
+    int shift = 63 - __builtin_clzl(value) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS +
+           (int)((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/*
+ * Largest value that lands in the bucket
+ */
+static long bucket_limit(int bucket) {
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    if (shift < 0)
+        return bucket;
+    long low = (long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS)
+               << shift;
+    return low + ((1L << shift) - 1);
+}
+
+void sfs_latency_record(fs_op op, long start) {
+    long value = sfs_latency_start() - start;
+    latency_histogram *h = &histograms[op];
+    __atomic_fetch_add(&h->buckets[latency_bucket(value)], 1,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&h->max, &max, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static int append_op(char *buf, int size, int length, const char *op,
+                     const char *name, long value) {
+    length = append_text(buf, size, length, op);
+    length = append_text(buf, size, length, ".");
+    return append(buf, size, length, name, value);
+}
+
+int sfs_latency_format(char *buf, int size) {
+    static const struct {
+        const char *name;
+        int permille;
+    } percentiles[] = {
+        {"p50_ns", 500}, {"p90_ns", 900}, {"p99_ns", 990}, {"p999_ns", 999}};
+    if (size <= 0)
+        return 0;
+    buf[0] = '\0';
+    int length = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        latency_histogram *h = &histograms[op];
+        // a snapshot, records may land while it is taken
+        long buckets[LATENCY_BUCKETS];
+        long count = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+            count += buckets[i];
+        }
+        if (count == 0)
+            continue;
+        const char *name = op_names[op];
+        length = append_op(buf, size, length, name, "count", count);
+        long max = load(&h->max);
+        length = append_op(buf, size, length, name, "mean_ns",
+                           load(&h->sum) / count);
+        for (int p = 0; p < 4; p++) {
+            long rank = (count * percentiles[p].permille + 999) / 1000;
+            long seen = 0;
+            int i = 0;
+            while (i < LATENCY_BUCKETS - 1 && seen + buckets[i] < rank) {
+                seen += buckets[i++];
+            }
+            // the top bucket can reach past the largest value
+            long value = bucket_limit(i) < max ? bucket_limit(i) : max;
+            length = append_op(buf, size, length, name, percentiles[p].name,
+                               value);
+        }
+        length = append_op(buf, size, length, name, "max_ns", max);
+        // the distribution, one line per bucket that is not empty
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (buckets[i] == 0)
+                continue;
+            length = append_text(buf, size, length, name);
+            length = append_text(buf, size, length, ".le_ns.");
+            length = append_long(buf, size, length, bucket_limit(i));
+            length = append_text(buf, size, length, " ");
+            length = append_long(buf, size, length, buckets[i]);
+            length = append_text(buf, size, length, "\n");
+        }
+    }
+    return length;
+}
+
+void sfs_latency_reset(void) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        latency_histogram *h = &histograms[op];
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            __atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void dump_latency(int signal) {
+    (void)signal;
+    static char text[65536];
+    int saved = errno;
+    int length = sfs_latency_format(text, sizeof(text));
+    for (int done = 0; done < length;) {
+        ssize_t n = write(dump_fd, text + done, length - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    errno = saved;
+}
+
+void sfs_latency_install_dump(void) {
+    const char *path = getenv(SFS_LATENCY_DUMP_ENV);
+    if (path == NULL)
+        path = SFS_LATENCY_DUMP_FILE;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0)
+        dump_fd = fd;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_latency;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
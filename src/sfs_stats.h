@@ -0,0 +1,115 @@
+#ifndef SFS_STATS_H
+#define SFS_STATS_H
+
+/*
+ * Read only file of the FUSE wrappers that shows the counters, truncating it
+ * resets them
+ */
+#define SFS_STATS_FILE "/.sfs_stats"
+
+/*
+ * Read only file with the latency histograms of the FUSE operations,
+ * truncating it resets them. SIGUSR1 appends them to the file named by
+ * SFS_LATENCY_DUMP, sfs_latency.txt in the working directory by default
+ * (opened at start up, before FUSE goes to the background and loses stderr)
+ */
+#define SFS_LATENCY_FILE "/.sfs_latency"
+#define SFS_LATENCY_DUMP_ENV "SFS_LATENCY_DUMP"
+#define SFS_LATENCY_DUMP_FILE "sfs_latency.txt"
+
+/*
+ * Histogram buckets: values below 8 ns get their own bucket, above that each
+ * power of 2 is split in 8 (3 significant bits, at most 12.5% off)
+ */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+typedef enum {
+    OP_GETATTR,
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_RELEASE,
+    OP_CREATE,
+    OP_UNLINK,
+    OP_TRUNCATE,
+    OP_FSYNC,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_COUNT
+} fs_op;
+
+/*
+ * Counters of the layers above disk_emu and the buffer cache (they keep their
+ * own). Bumped from every thread with relaxed atomics
+ */
+typedef struct {
+    long bytes_served;
+    long bytes_copied;
+    long write_buffer_errors;
+    long serialize_calls;
+    long deserialize_calls;
+    long fbm_syncs;
+    long reclaim_map_syncs;
+    long inode_syncs;
+    long dir_block_syncs;
+    long journal_commits;
+    long journal_blocks;
+    long alloc_calls;
+    long alloc_words_scanned;
+    long alloc_regions_skipped;
+    long dir_lookups;
+    long dir_probes;
+    long dcache_hits;
+    long dcache_negative_hits;
+    long bmap_lookups;
+    long bmap_loads;
+} sfs_counters;
+
+extern sfs_counters counters;
+
+#define COUNT(field, n)                                                        \
+    __atomic_fetch_add(&counters.field, (long)(n), __ATOMIC_RELAXED)
+#define COUNT_BYTES_COPIED(n) COUNT(bytes_copied, n)
+#define COUNT_BYTES_SERVED(n) COUNT(bytes_served, n)
+
+/*
+ * Writes every counter (disk, buffer cache and the ones above) into the
+ * buffer as "name value" lines. Returns the length of the text, which is cut
+ * short if the buffer is too small
+ */
+int sfs_stats_format(char *, int);
+
+/*
+ * Sets every counter back to 0
+ */
+void sfs_stats_reset(void);
+
+/*
+ * Monotonic clock in ns, the start of a timed operation
+ */
+long sfs_latency_start(void);
+
+/*
+ * Adds the time since start to the histogram of the operation, lock free
+ */
+void sfs_latency_record(fs_op, long);
+
+/*
+ * Writes the histograms (count, mean, p50/p90/p99/p999, max and the non
+ * empty buckets of every operation that ran) as "name value" lines. Returns
+ * the length of the text. Async signal safe
+ */
+int sfs_latency_format(char *, int);
+
+void sfs_latency_reset(void);
+
+/*
+ * Dumps the histograms on SIGUSR1, to stderr if the dump file cannot be
+ * opened
+ */
+void sfs_latency_install_dump(void);
+
+#endif